@@ -0,0 +1,86 @@
+#!/bin/bash
+# usage: gen.sh aliases|nest|chain|vlist|exec n
+#        gen.sh tree dir depth fanout files
+# writes a synthetic sake script to stdout, or builds a directory tree
+# with fanout subdirectories and files entries per directory, depth
+# levels deep
+
+kind=$1
+n=${2:-1000}
+
+case "$kind" in
+aliases)
+    # n aliases, all read back by a last statement
+    awk -v n="$n" 'BEGIN {
+        for (i = 0; i < n; ++i) printf "a%d = [ f%d.c f%d.h ];\n", i, i, i
+        printf "all = {"
+        for (i = 0; i < n; ++i) printf " a%d", i
+        print " };"
+    }'
+    ;;
+nest)
+    # one expression nested n round brackets deep
+    awk -v n="$n" 'BEGIN {
+        printf "x = "
+        for (i = 0; i < n; ++i) printf "( "
+        printf "a"
+        for (i = 0; i < n; ++i) printf " + b )"
+        print ";"
+    }'
+    ;;
+chain)
+    # one + chain of n string terms
+    awk -v n="$n" 'BEGIN {
+        printf "x = s0"
+        for (i = 1; i < n; ++i) printf " + s%d", i
+        print ";"
+        print "y = x + [ a b ];"
+    }'
+    ;;
+vlist)
+    # a {} vlist of n rows, then broadcast over it
+    awk -v n="$n" 'BEGIN {
+        printf "x = {"
+        for (i = 0; i < n; ++i) printf " r%d", i
+        print " };"
+        print "y = [ cc ] + x + .o;"
+        print "z = y - .o;"
+    }'
+    ;;
+exec)
+    # n rows of true run by one statement
+    awk -v n="$n" 'BEGIN {
+        printf "[ true ] + {"
+        for (i = 0; i < n; ++i) printf " r%d", i
+        print " };"
+    }'
+    ;;
+tree)
+    dir=$2
+    depth=${3:-3}
+    fanout=${4:-4}
+    files=${5:-16}
+    mkdir -p "$dir"
+    awk -v dir="$dir" -v depth="$depth" -v fanout="$fanout" \
+        -v files="$files" '
+    function fill(path, level,    i) {
+        for (i = 0; i < files; ++i) print path "/f" i ".c"
+        if (level == depth) return
+        for (i = 0; i < fanout; ++i) {
+            print path "/d" i "/"
+            fill(path "/d" i, level + 1)
+        }
+    }
+    BEGIN { fill(dir, 0) }' | while read -r path; do
+        case "$path" in
+        */) mkdir -p "$path" ;;
+        *) : > "$path" ;;
+        esac
+    done
+    ;;
+*)
+    echo "usage: $0 aliases|nest|chain|vlist|exec n" >&2
+    echo "       $0 tree dir depth fanout files" >&2
+    exit 1
+    ;;
+esac
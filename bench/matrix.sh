@@ -0,0 +1,127 @@
+#!/bin/bash
+# usage: matrix.sh [sake] [runs] [sizes]
+# times every implemented cell of the + - / % operand type matrix over
+# lists of each size (1000 10000 100000 by default) and prints
+#     op cell n runs ns/elem allocs/elem
+# each cell is measured as f op s minus a baseline that only copies f and
+# s, using the eval time and alloc/reallocptr counters of sake -s; every
+# run times the baseline and the cell back to back and the median of the
+# runs differences is reported; a cell whose median is within half the
+# interquartile range of its differences is marked "noise"; the first
+# operand holds n names and the second n / 4 of them
+
+sake=${1:-./sake}
+runs=${2:-11}
+sizes=${3:-1000 10000 100000}
+work=$(mktemp -d)
+
+trap 'rm -rf "$work"' EXIT
+
+# op, first operand type, second operand type
+cells="
+add str str
+add str hlist
+add str vlist
+add hlist str
+add hlist hlist
+add hlist vlist
+add vlist str
+add vlist hlist
+add vlist vlist
+sub str hlist
+sub str vlist
+sub hlist str
+sub hlist hlist
+sub vlist str
+sub vlist hlist
+div str hlist
+div str vlist
+div hlist str
+div hlist hlist
+div vlist str
+div vlist hlist
+mod str hlist
+mod str vlist
+mod hlist str
+mod hlist hlist
+mod vlist str
+mod vlist hlist
+"
+
+# operand of the given type and size: a single string, or a list of n
+# names, half .c and half .h, of which the second operand holds every
+# fourth so that set operations drop some and keep some
+operand() {
+    awk -v type="$1" -v n="$2" -v step="$3" 'BEGIN {
+        if (type == "str") {
+            print (step == 1) ? "src." : ".c"
+            exit
+        }
+        printf (type == "hlist") ? "[" : "{"
+        for (i = 0; i < n; i += step)
+            printf " src.f%d%s", i, (i % 2) ? ".h" : ".c"
+        print (type == "hlist") ? " ]" : " }"
+    }'
+}
+
+# prints eval_ns and allocations of one run
+sample() {
+    if ! "$sake" -s -i "$1" 2> "$work/stats" > /dev/null; then
+        cat "$work/stats" >&2
+        exit 1
+    fi
+    awk '
+    $2 == "eval_ns" { ns = $3 }
+    $2 == "alloc" || $2 == "reallocptr" { n += $3 }
+    END { print ns, n }' "$work/stats"
+}
+
+# median and half the interquartile range of a column of numbers
+spread() {
+    sort -n | awk '{ v[NR] = $1 } END {
+        iqr = v[int((3 * NR + 3) / 4)] - v[int((NR + 3) / 4)]
+        print v[int((NR + 1) / 2)], iqr / 2
+    }'
+}
+
+printf "%-4s %-12s %7s %4s %10s %12s\n" op cell n runs ns/elem allocs/elem
+
+echo "$cells" | while read -r op ft st; do
+    [ -n "$op" ] || continue
+    case $op in
+    add) sym=+ ;;
+    sub) sym=- ;;
+    div) sym=/ ;;
+    mod) sym=% ;;
+    esac
+    for n in $sizes; do
+        # + of an hlist and a vlist appends the whole hlist to every row,
+        # so keep the hlist short to stay linear in n
+        fn=$n
+        sn=$n
+        case $op-$ft-$st in
+        add-hlist-vlist) fn=4 ;;
+        add-vlist-hlist) sn=16 ;;
+        esac
+        {
+            echo "f = $(operand "$ft" "$fn" 1);"
+            echo "s = $(operand "$st" "$sn" 4);"
+        } > "$work/operands"
+        { cat "$work/operands"; echo "x = f; y = s;"; } > "$work/base.sk"
+        { cat "$work/operands"; echo "x = f $sym s;"; } > "$work/cell.sk"
+        for ((i = 0; i < runs; ++i)); do
+            base=$(sample "$work/base.sk") || exit 1
+            cell=$(sample "$work/cell.sk") || exit 1
+            echo "$base $cell" >> "$work/diff"
+        done
+        read -r ns noise < <(awk '{ print $3 - $1 }' "$work/diff" | spread)
+        read -r allocs _ < <(awk '{ print $4 - $2 }' "$work/diff" | spread)
+        awk -v op="$op" -v cell="${ft}_$st" -v n="$n" -v runs="$runs" \
+            -v ns="$ns" -v noise="$noise" -v allocs="$allocs" 'BEGIN {
+            printf "%-4s %-12s %7d %4d %10.2f %12.3f%s\n", op, cell, n, runs,
+                ns / n, allocs / n, (ns <= noise && -ns <= noise) ? \
+                " noise" : ""
+        }'
+        rm -f "$work/diff"
+    done
+done
@@ -0,0 +1,71 @@
+#!/bin/bash
+# usage: run.sh [sake] [runs] [scale]
+# runs every generated case runs times (11 by default) under sake -s and
+# prints one line per case and phase:
+#     case phase runs median p10 p90 (ns)
+# sizes are multiplied by scale; the output is sorted so that two runs
+# from different commits can be compared with diff or join
+
+sake=${1:-./sake}
+runs=${2:-11}
+scale=${3:-1}
+gen=$(dirname "$0")/gen.sh
+work=$(mktemp -d)
+
+trap 'rm -rf "$work"' EXIT
+
+# case name, gen.sh kind, size
+scripts="
+aliases aliases 20000
+nest nest 2000
+chain chain 20000
+vlist vlist 50000
+exec exec 200
+"
+
+measure() {
+    local name=$1 script=$2 i
+
+    for ((i = 0; i < runs; ++i)); do
+        "$sake" -s -i "$script" 2>&1 >/dev/null |
+            awk -v name="$name" '$1 == "stats:" && $2 ~ /_ns$/ {
+                sub(/_ns$/, "", $2)
+                print name, $2, $3
+            }'
+    done
+}
+
+{
+    echo "$scripts" | while read -r name kind n; do
+        [ -n "$name" ] || continue
+        n=$((n * scale))
+        "$gen" "$kind" "$n" > "$work/$name.sk"
+        measure "$name-$n" "$work/$name.sk"
+    done
+
+    files=$((2000 * scale))
+    "$gen" tree "$work/flat" 0 0 "$files"
+    echo "x = @'$work/flat';" > "$work/list.sk"
+    measure "list-$files" "$work/list.sk"
+    echo "x = @@'$work/flat';" > "$work/stat.sk"
+    measure "stat-$files" "$work/stat.sk"
+
+    "$gen" tree "$work/tree" 3 $((4 * scale)) 16
+    echo "x = @'$work/tree/**/*.c';" > "$work/glob.sk"
+    measure "glob-$((4 * scale))x3" "$work/glob.sk"
+} | sort -k1,1 -k2,2 -k3,3n | awk '
+function flush(    lo, hi) {
+    if (n == 0) return
+    lo = int((n - 1) * 0.1) + 1
+    hi = int((n - 1) * 0.9 + 0.5) + 1
+    printf "%-16s %-9s %3d %12d %12d %12d\n", key[1], key[2], n,
+        v[int((n + 1) / 2)], v[lo], v[hi]
+    n = 0
+}
+BEGIN {
+    printf "%-16s %-9s %3s %12s %12s %12s\n", "case", "phase", "runs",
+        "median", "p10", "p90"
+}
+$1 != key[1] || $2 != key[2] { flush(); key[1] = $1; key[2] = $2 }
+{ v[++n] = $3 }
+END { flush() }'
@@ -0,0 +1,25 @@
+#!/bin/bash
+# usage: setop.sh [sake] [n] [m]
+# times list difference and intersection of an n-entry list against an
+# m-entry one (100000 x 10000 by default)
+
+sake=${1:-./sake}
+n=${2:-100000}
+m=${3:-10000}
+script=$(mktemp)
+
+trap 'rm -f "$script"' EXIT
+
+awk -v n="$n" -v m="$m" 'BEGIN {
+    printf "src = ["
+    for (i = 0; i < n; ++i) printf " f%d.c", i
+    print " ];"
+    printf "excluded = ["
+    for (i = 0; i < m; ++i) printf " f%d.c", i * int(n / m)
+    print " ];"
+    print "rest = src - excluded;"
+    print "kept = src % excluded;"
+    print "both = src / excluded;"
+}' > "$script"
+
+time "$sake" -i "$script"
@@ -1,22 +1,84 @@
-// gcc -O0 -g self -o sake -Wall -Wextra -pedantic -Wno-unused-function
+// gcc -O0 -g self -o sake -Wall -Wextra -pedantic -Wno-unused-function -pthread
+// gcc -O2 -g -fPIC -shared -DSAKE_LIB self -o libsake.so -pthread
+
+#define _GNU_SOURCE
 
 #include <assert.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <linux/fs.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#ifdef SAKE_LIB
+#include "sake.h"
+#endif
 
 #define DEALLOC_QUOTA 0x200000
+#define FILT_BATCH 64
+#define PAR_ROWS 4096
+#define DENTS_BUF 0x40000
+#define SORT_INSERT 16
+#define LISTING_MAGIC 0x3174736c656b6173
+#define HISTORY_MAGIC 0x32626f6a656b6173
+#define LOAD_REFRESH 100000000
+#define PSI_LIMIT 10.0
+#define MEM_RESERVE 0x40000
+#define REPORT_TOP 10
+#define HASH_OUT 2
+#define OUTPUTS_MAGIC 0x3174756f656b6173
+#define DIR_EVENTS                                                            \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |  \
+     IN_MOVE_SELF)
+#define FILE_EVENTS                                                           \
+    (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCH_SETTLE 50
+#define WATCH_DIR (IN_CREATE | IN_DELETE | IN_MOVE)
+#define WATCH_META (WATCH_DIR | IN_CLOSE_WRITE | IN_ATTRIB)
+#define SERVE_MSG 0x20000
+#define TRACE_SLOT0 0x400001
 
 typedef enum PARSE { PARSE_SKIP = 0, PARSE_MODIFY = 1 } PARSE;
 typedef enum FIL { FIL_DISCARD = 0, FIL_KEEP = 1 } FIL;
 typedef enum OFILE { OFILE_ERR = 0, OFILE_OUT = 1 } OFILE;
+typedef enum STAT { STAT_SKIP = 0, STAT_FETCH = 1 } STAT;
+typedef enum META { META_NEWER, META_LARGER, META_SMALLER, META_DTYPE } META;
+typedef enum JOB { JOB_ALL, JOB_MARKED } JOB;
+typedef enum SPLIT { SPLIT_WORDS, SPLIT_LINES } SPLIT;
+typedef enum PHASE {
+    PHASE_READ,
+    PHASE_TOKENIZE,
+    PHASE_MAP,
+    PHASE_EVAL,
+    PHASE_N
+} PHASE;
 
 typedef enum POS { POS_BEG, POS_END } POS;
 typedef enum TYPE { TYPE_STR, TYPE_HLIST, TYPE_VLIST } TYPE;
@@ -27,7 +89,11 @@ typedef enum SYM {
     SYM_UNOP_BEG,
     SYM_HASH,
     SYM_AT,
+    SYM_ATAT,
+    SYM_DOL,
+    SYM_DOLDOL,
     SYM_LESS,
+    SYM_GREAT,
     SYM_UNOP_END,
 
     SYM_PAREN_BEG,
@@ -68,7 +134,12 @@ typedef enum SYM {
 typedef struct Str {
     size_t len;
     short hash;
+    unsigned char dtype;
     char *data;
+    struct Rope *rope;
+    struct Share *share;
+    int64_t fsize;
+    int64_t fmtime;
 } Str;
 
 typedef struct Hlist {
@@ -102,20 +173,287 @@ typedef struct Map {
     struct Var *node;
 } Map;
 
+typedef struct Rope {
+    struct Arr pre;
+    struct Arr post;
+    size_t size;
+} Rope;
+
+typedef struct Share {
+    size_t refs;
+    size_t size;
+    size_t map;
+    char data[];
+} Share;
+
+typedef struct Listing {
+    uint64_t magic;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime;
+    int64_t ctime;
+    uint64_t len;
+    uint64_t size;
+} Listing;
+
+/* where one of the texts appended to copymk starts */
+typedef struct Source {
+    size_t off;
+    char *name;
+} Source;
+
+typedef struct Entry {
+    char kind;
+    int dead;
+    char *path;
+    char *base;
+    int wd;
+    int dwd;
+    int fd;
+    uint64_t sum;
+} Entry;
+
+typedef struct Dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} Dirent64;
+
+typedef struct Walkdir {
+    struct Walkdir *parent;
+    size_t refs;
+    size_t len;
+    char *path;
+    int fd;
+} Walkdir;
+
+typedef struct Walk {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct Arr queue;
+    size_t active;
+    size_t rootlen;
+    struct Str suffix;
+    int exact;
+    struct Hlist *found;
+    size_t *foundalloc;
+    uint32_t watchmask;
+    int err;
+    char *errpath;
+} Walk;
+
+typedef struct Set {
+    size_t alloc;
+    struct Str **data;
+} Set;
+
 typedef struct QuotaAlloc {
     struct Arr delay;
     size_t store;
 } QuotaAlloc;
 
+typedef struct Pool {
+    pthread_mutex_t owner;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    pthread_t *threads;
+    size_t nthreads;
+    size_t gen;
+    size_t busy;
+    void (*fn)(void *, size_t, size_t);
+    void *arg;
+    size_t n;
+} Pool;
+
+typedef struct RowOp {
+    struct Vlist *vl;
+    struct Hlist *hl;
+    struct Str *str;
+    enum POS pos;
+    enum FIL fil;
+    enum STAT stat;
+    int fd;
+    int *errs;
+} RowOp;
+
+typedef struct Job {
+    struct Hlist args;
+    char **cmd;
+    char *msg;
+    pid_t pid;
+    int pidfd;
+    int out;
+    int marked;
+    uint64_t outkey;
+    uint64_t key;
+    uint64_t bytes;
+    int64_t estimate;
+    int64_t start;
+    uint64_t rss;
+    size_t weight;
+    int64_t queued;
+    size_t slot;
+    size_t seq;
+} Job;
+
+typedef struct JobTime {
+    uint64_t key;
+    int64_t ns;
+    uint64_t bytes;
+    uint64_t rss;
+} JobTime;
+
+typedef struct History {
+    struct JobTime *data;
+    size_t len;
+    double rate;
+    int dirty;
+} History;
+
+typedef struct Sched {
+    size_t limit;
+    size_t weight;
+    struct Arr pending;
+    struct Arr running;
+    struct Arr weights;
+} Sched;
+
+typedef struct Usage {
+    char *cmd;
+    int status;
+    int64_t wall;
+    int64_t utime;
+    int64_t stime;
+    int64_t maxrss;
+    int64_t nvcsw;
+    int64_t nivcsw;
+} Usage;
+
+typedef struct Stats {
+    uint64_t searches;
+    uint64_t copies;
+    uint64_t copybytes;
+    uint64_t allocs;
+    uint64_t allocbytes;
+    uint64_t reallocs;
+    uint64_t reallocbytes;
+    uint64_t frees;
+    uint64_t freebytes;
+    uint64_t flushes;
+    uint64_t converts[3][3];
+    uint64_t forks;
+} Stats;
+
+typedef struct Load {
+    int64_t at;
+    long ncpu;
+    double avg1;
+    double mempsi;
+    uint64_t memavail;
+} Load;
+
+typedef struct Watch {
+    int wd;
+    uint32_t mask;
+    char *name;
+    size_t stmt;
+} Watch;
+
+typedef struct Stmt {
+    char **beg;
+    char **end;
+    size_t alias;
+    struct Arr reads;
+    int dirty;
+} Stmt;
+
+typedef struct MetaFilt {
+    struct Hlist *hl;
+    enum META kind;
+    int64_t val;
+    unsigned char *keep;
+} MetaFilt;
+
+#ifdef SAKE_LIB
+/* what the thread globals hold while a library call runs on the context */
+struct Sake {
+    char *fname;
+    char *copymk;
+    size_t mklen;
+    size_t mkalloc;
+    struct Arr texts;
+    struct Arr srcs;
+    struct Arr quotarr;
+    struct Arr tokarr;
+    struct Map aliasmap;
+};
+
+struct SakeVal {
+    struct Var var;
+};
+#endif
+
 extern char *__progname;
-static char *plainmk;
-static char *copymk;
-static const char *fname = "m.sk";
-static size_t flen;
-static struct Arr quotarr;
-static struct Arr tokarr;
-static struct Map aliasmap;
-static struct QuotaAlloc squalo;
+static _Thread_local char *plainmk;
+static _Thread_local char *copymk;
+static _Thread_local const char *fname = "m.sk";
+static _Thread_local struct Arr *srcarr;
+#ifndef SAKE_LIB
+static const char *cachedir;
+static int memo;
+static int artifacts;
+static int cachefd = -1;
+static int cacheserve;
+static const char *servepath;
+static const char *askpath;
+static int servefd = -1;
+static pthread_mutex_t cachelock = PTHREAD_MUTEX_INITIALIZER;
+static struct Arr entries;
+/* the entries by the wd of their file or directory */
+static struct Arr *wdents;
+static size_t nwdents;
+static struct Arr memoenv;
+#endif
+static _Thread_local size_t flen;
+static _Thread_local struct Arr quotarr;
+static _Thread_local struct Arr tokarr;
+static _Thread_local struct Map aliasmap;
+static _Thread_local struct QuotaAlloc squalo;
+static _Thread_local int inpool;
+static _Thread_local struct Sched sched;
+static _Thread_local struct History history;
+static _Thread_local struct Load load;
+#ifndef SAKE_LIB
+static const char *reportfile;
+static struct Arr usagearr;
+static int64_t runstart;
+static FILE *tracef;
+static int64_t tracestart;
+static size_t traceslots;
+static size_t traceseq;
+static pthread_mutex_t tracelock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static _Thread_local struct Stats stats;
+static struct Arr statsarr;
+static pthread_mutex_t statslock = PTHREAD_MUTEX_INITIALIZER;
+#ifndef SAKE_LIB
+static int64_t phases[PHASE_N];
+static int watchfd = -1;
+static struct Arr watcharr;
+static struct Stmt *stmtv;
+static struct Stmt *currstmt;
+static pthread_mutex_t watchlock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static _Thread_local jmp_buf *stmtjmp;
+static struct Pool pool = {
+    .owner = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+};
 static const unsigned char escape[1 << 8][2] = {
     { 0x0 },  { 0x1 },  { 0x2 },  { 0x3 },  { 0x4 },  { 0x5 },  { 0x6 },
     { 0x7 },  { 0x8 },  { 0x9 },  { 0xa },  { 0xb },  { 0xc },  { 0xd },
@@ -161,11 +499,13 @@ static const char litts[][3] = {
             [SYM_L_SBRACK] = "[", [SYM_R_RBRACK] = ")", [SYM_L_RBRACK] = "(",
             [SYM_PLUS] = "+",     [SYM_SUB] = "-",      [SYM_MUL] = "*",
             [SYM_DIV] = "/",      [SYM_MOD] = "%",      [SYM_EQ] = "=",
-            [SYM_HASH] = "#",     [SYM_AT] = "@",
+            [SYM_HASH] = "#",     [SYM_AT] = "@",       [SYM_ATAT] = "@@",
+            [SYM_DOL] = "$",      [SYM_DOLDOL] = "$$",
 
             [SYM_SPACE] = " ",    [SYM_NLINE] = "\n",   [SYM_TAB] = "\t",
             [SYM_QUOT] = "\'",    [SYM_ESCAPE] = "\\",  [SYM_UP] = "^",
-            [SYM_LESS] = "<",     [SYM_SEMICOL] = ";",  [SYM_LARROW] = "<-",
+            [SYM_LESS] = "<",     [SYM_GREAT] = ">",    [SYM_SEMICOL] = ";",
+            [SYM_LARROW] = "<-",
             [SYM_RARROW] = "->",  [SYM_QCOL] = "::",
 };
 
@@ -175,10 +515,14 @@ static const char *symmap[1 << 16] = {
             [')'] = litts[SYM_R_RBRACK], ['('] = litts[SYM_L_RBRACK],
             ['+'] = litts[SYM_PLUS],     ['-'] = litts[SYM_SUB],
             ['#'] = litts[SYM_HASH],     ['@'] = litts[SYM_AT],
+            [('@' << 8) | '@'] = litts[SYM_ATAT],
+            ['$'] = litts[SYM_DOL],
+            [('$' << 8) | '$'] = litts[SYM_DOLDOL],
             ['/'] = litts[SYM_DIV],      ['%'] = litts[SYM_MOD],
             ['*'] = litts[SYM_MUL],      ['='] = litts[SYM_EQ],
 
             ['^'] = litts[SYM_UP],       ['<'] = litts[SYM_LESS],
+            ['>'] = litts[SYM_GREAT],
             [';'] = litts[SYM_SEMICOL],  [' '] = litts[SYM_SPACE],
             ['\t'] = litts[SYM_TAB],     ['\\'] = litts[SYM_ESCAPE],
             ['\''] = litts[SYM_QUOT],
@@ -195,11 +539,17 @@ static const char *symmap[1 << 16] = {
         }                                                                     \
     } while (0)
 
+#ifndef SAKE_LIB
 static void addusrcmds(char **, size_t);
 static void initparse();
+#endif
 static char *itertokm(char *, int);
 static char *readall(const char *);
+static _Noreturn void failread(FILE *, char *, const char *);
 static void sigerrn(size_t, char *);
+static _Noreturn void sigerrx(const char *, ...);
+static _Noreturn void sigerr(const char *, ...);
+static void sigerrno(size_t, const char *);
 static void showerrn(size_t, char *);
 static char *advance(char *, int);
 static int isnotsigil(char *);
@@ -210,11 +560,16 @@ static int isparen(char *);
 static int isterm(char *);
 static void printtok(char **, char **);
 static void *memown(void *, size_t);
+static void initstr(struct Str *, char *, size_t);
 static Str *copystr(struct Str *);
 static Hlist *copyhlist(struct Hlist *);
 static Vlist *copyvlist(struct Vlist *);
 static void copyval(struct Var *, struct Var *);
 static void freestr(struct Str *);
+static void freerope(struct Rope *);
+static void sharehlist(struct Hlist *, size_t);
+static void dropshare(struct Share *);
+static void unsharestr(struct Str *);
 static void freehlist(struct Hlist *);
 static void freevlist(struct Vlist *);
 static void freeval(struct Var *);
@@ -228,7 +583,51 @@ static void pushlist(void *, void *, size_t);
 static Hlist *emptyhlist();
 static Vlist *emptyvlist();
 static void hashval(struct Var *);
+static void outval(struct Var *);
 static void exec(struct Var *, char **);
+static pid_t spawn(struct Hlist *, char ***, size_t *, int);
+static struct Job *queuejob(struct Hlist *, char **, char *, int);
+static size_t pickjob(void);
+static int admitjob(struct Job *);
+static void startjob(size_t);
+static void reapjob(void);
+static int openpidfd(pid_t);
+static pid_t waitrunning(int *, struct rusage *);
+static void runjobs(void);
+static void waitjobs(enum JOB);
+static size_t conflictjobs(struct Var *);
+static int needsbarrier(char **, char **);
+static int64_t monons(void);
+static uint64_t jobbytes(struct Hlist *);
+static struct JobTime *findtime(uint64_t);
+static void recordtime(struct Job *, int64_t);
+static size_t jobweight(struct Hlist *);
+static void readload(void);
+#ifndef SAKE_LIB
+static void recordusage(struct Job *, struct rusage *, int, int64_t);
+static int sortusage(const void *, const void *);
+static void reportjobs(void);
+static char *joinargs(struct Hlist *);
+static void opentrace(const char *);
+static void closetrace(void);
+static int64_t tracenow(void);
+static void traceevent(const char *, const char *, const char *, int64_t,
+                       int64_t, long, const char *);
+static void tracespan(const char *, const char *, int64_t, long);
+static void tracestmt(char **, char **, int64_t);
+static void tracestr(const char *);
+static long tracetid(void);
+static void tracejob(struct Job *);
+#endif
+static void addstats(void);
+#ifndef SAKE_LIB
+static void printstats(void);
+#endif
+static int sorttime(const void *, const void *);
+#ifndef SAKE_LIB
+static void loadhistory(void);
+static void savehistory(void);
+#endif
 static void evalmk(char **, char **);
 static void evalstmnt(char **, char **);
 static char **evalexpr(struct Var *, char **, char **);
@@ -259,6 +658,10 @@ static struct Hlist *hlistfromvlist(struct Vlist *);
 static void convert(struct Var *, enum TYPE);
 static void appendstr(struct Str *, struct Str *);
 static void prepend(struct Str *, struct Str *);
+static void ropestr(struct Str *, struct Str *, enum POS);
+static char *writestr(char *, struct Str *);
+static char *flatstr(struct Str *);
+static void flathlist(struct Hlist *);
 static struct Str *addstrstr(struct Str *, struct Str *);
 static struct Hlist *addstrhlist(struct Str *, struct Hlist *);
 static struct Vlist *addstrvlist(struct Str *, struct Vlist *);
@@ -271,9 +674,11 @@ static struct Vlist *addvliststr(struct Vlist *, struct Str *);
 static struct Str *concatstr(struct Str *, struct Str *);
 static struct Hlist *concathlist(struct Hlist *, struct Hlist *);
 static struct Vlist *concatvlist(struct Vlist *, struct Vlist *);
-static void execbinaryop(struct Var *, struct Var *, char *);
+static void execbinaryop(struct Var *, struct Var *, char **);
 static void addval(struct Var *, struct Var *);
 static int matchstrstr(struct Str *, struct Str *, enum POS, enum FIL);
+static uint64_t keystr(struct Str *, size_t, enum POS);
+static uint64_t matchkeys(uint64_t *, size_t, uint64_t, uint64_t);
 static struct Hlist *
 filthlist(struct Hlist *, struct Str *, enum POS, enum FIL);
 static struct Vlist *
@@ -282,32 +687,151 @@ static void subval(struct Var *, struct Var *);
 static struct Hlist *subhliststr(struct Hlist *f, struct Str *, enum POS);
 static struct Vlist *subvliststr(struct Vlist *f, struct Str *, enum POS);
 static void filtval(struct Var *, struct Var *, char *);
-static struct Hlist *atstr(struct Str *, char **);
-static int cmpstr(const void *, const void *);
-static void atval(struct Var *, char **);
+static size_t hashstr(struct Str *);
+static void setfromhlist(struct Set *, struct Hlist *);
+static int insetstr(struct Set *, struct Str *);
+static void freeset(struct Set *);
+static struct Hlist *filthlistset(struct Hlist *, struct Set *, enum FIL);
+static struct Vlist *filtvlistset(struct Vlist *, struct Set *, enum FIL);
+static void filtvalset(struct Var *, struct Hlist *, enum FIL);
+static struct Hlist *atstr(struct Str *, char **, enum STAT);
+static int listdir(struct Hlist *, char *, enum STAT);
+static int statlist(struct Hlist *, char *);
+static void statrows(void *, size_t, size_t);
+static int readdirents(struct Hlist *, char *);
+#ifndef SAKE_LIB
+static int statlisting(char *, struct Listing *);
+static char *listingpath(struct Listing *);
+static int loadlisting(struct Hlist *, struct Listing *);
+static int maplisting(struct Hlist *, int, struct Listing *);
+static void storelisting(struct Hlist *, struct Listing *);
+static void writelisting(FILE *, struct Hlist *, struct Listing *);
+#endif
+static struct Vlist *atlist(struct Hlist *, char **, enum STAT);
+static void atlistrows(void *, size_t, size_t);
+static void sortstrv(struct Str *, size_t, size_t);
+static struct Hlist *globstr(struct Str *, char *, char **, enum STAT);
+static void walkdirs(void *, size_t, size_t);
+static void walkdir(struct Walk *, struct Walkdir *, size_t);
+static void failwalk(struct Walk *, char *);
+static void pushwalkdir(struct Walk *, struct Walkdir *, char *);
+static void dropwalkdir(struct Walkdir *);
+static void atval(struct Var *, char **, enum STAT);
+static void capval(struct Var *, char **, enum SPLIT);
+static struct Share *mapcapture(int);
+static size_t splitwords(char *, char *, struct Str *, struct Share *);
+static size_t splitshare(struct Share *, void *, enum SPLIT);
+#ifndef SAKE_LIB
+static uint64_t hashbytes(uint64_t, const void *, size_t);
+static uint64_t mixword(uint64_t);
+static uint64_t hashfile(char *);
+static uint64_t memokey(struct Hlist *);
+static char *curdir(void);
+static void servecache(void);
+static int answercache(int, int);
+static size_t findentry(struct Entry *);
+static struct Entry *addentry(char, char *, int, size_t);
+static void freeentry(struct Entry *, int);
+static void indexwd(int, struct Entry *);
+static void unindexwd(int, struct Entry *);
+static void unwatch(int, int);
+static int sortentry(const void *, const void *);
+static void readentries(int);
+static void opencache(void);
+static int askcache(char, char *, uint64_t *, int *);
+static struct Share *loadmemo(uint64_t);
+static void storememo(uint64_t, struct Share *);
+static void writeatomic(char *, const void *, size_t);
+static char *cachepath(char, uint64_t);
+static size_t countoutputs(struct Hlist *);
+static int restoreoutputs(uint64_t, struct Hlist *);
+static void storeoutputs(uint64_t, struct Hlist *);
+static int copyto(int, size_t, char *, mode_t);
+static int copyfile(int, int, size_t);
+#endif
+static void parsemeta(struct Str *, struct MetaFilt *, char **);
+static int matchmeta(struct Str *, struct MetaFilt *);
+static struct Hlist *metahlist(struct Hlist *, struct MetaFilt *);
+static void metarows(void *, size_t, size_t);
+static void metaval(struct Var *, struct Var *, char **);
 static void freemem(void *, size_t);
+static void flushmem(void);
+static size_t initpool(void);
+static void *poolworker(void *);
+static void parrows(size_t, void (*)(void *, size_t, size_t), void *);
+static void parsplit(size_t, void (*)(void *, size_t, size_t), void *);
+static void addstrvlistrows(void *, size_t, size_t);
+static void addhlistvlistrows(void *, size_t, size_t);
+static void addvlisthlistrows(void *, size_t, size_t);
+static void addvliststrrows(void *, size_t, size_t);
+static void subvliststrrows(void *, size_t, size_t);
+static void filtvlistrows(void *, size_t, size_t);
+static void appendmk(char *);
+#ifndef SAKE_LIB
+static void watchpath(char *, char *, uint32_t);
+static void watchfile(char *, uint32_t);
+static void dropwatches(size_t);
+static size_t initstmts(char **, char **);
+static void evalwatched(struct Stmt *, size_t);
+static int readwatch(size_t, char *, char **);
+static void watchmk(char **);
+static void servemk(char **);
+static void runrequest(int);
+static int listenlocal(int, struct sockaddr_un *);
+static int ownpeer(int);
+static void *watchclient(void *);
+static void replyrequest(int, void *);
+static void addwarmcmds(char **, size_t);
+static int askserver(int, char **, int *);
+static int parseopts(int, char **);
+static void checkopts(void);
 static void print_help(void);
+#else
+static void enterctx(struct Sake *, jmp_buf *);
+static void addsource(struct Sake *, const char *);
+static void leavectx(struct Sake *);
+static void dropthread(void);
+#endif
 
+#ifndef SAKE_LIB
 int
 main(int argc, char *argv[]) {
+    int64_t t0;
     char *tok;
-    int c;
-
-    while ((c = getopt(argc, argv, "hi:")) != -1) {
-        if (c == 'i') {
-            fname = optarg;
-        } else if (c == 'h') {
-            print_help();
-            return 0;
+    int status;
+    int nrun;
+
+    addstats();
+    nrun = parseopts(argc, argv);
+    checkopts();
+    if (askpath && watchfd == -1 && !cacheserve &&
+        askserver(argc, argv, &status)) {
+        return status;
+    }
+    if (servepath && (optind != argc || nrun)) {
+        errx(1, "-S takes no commands and no options but -i");
+    }
+    if (cacheserve) {
+        if (cachedir == NULL) {
+            errx(1, "-d needs a cachedir");
         }
+        servecache();
+    } else if (cachedir) {
+        opencache();
     }
+    loadhistory();
+    t0 = monons();
     plainmk = readall(fname);
     addusrcmds(argv + optind, argc - optind);
     initparse();
+    phases[PHASE_READ] = monons() - t0;
+    t0 = monons();
     tok = itertokm(plainmk, PARSE_MODIFY);
     while ((tok = itertokm(NULL, PARSE_MODIFY)) != NULL) {
         pusharr(&tokarr, tok);
     }
+    phases[PHASE_TOKENIZE] = monons() - t0;
+    tracespan("parse", "tokenize", t0, 0);
     if (tokarr.len == 0) {
         return 0;
     } else if (chrbeg(&tokarr)[tokarr.len - 1] != litts[SYM_SEMICOL]) {
@@ -316,18 +840,126 @@ main(int argc, char *argv[]) {
     shrinkarr(&quotarr);
     shrinkarr(&tokarr);
     sortstrarr(&quotarr);
+    t0 = monons();
     mapfromarr(&aliasmap, &tokarr);
+    phases[PHASE_MAP] = monons() - t0;
+    tracespan("parse", "mapfromarr", t0, 0);
 
+    runstart = monons();
+    if (servepath) {
+        servemk(argv);
+    }
+    if (watchfd != -1) {
+        watchmk(argv);
+    }
     evalmk(chrbeg(&tokarr), chrend(&tokarr));
+    phases[PHASE_EVAL] = monons() - runstart;
     return 0;
 }
 
+/* the number of options changing how the commands run */
+static int
+parseopts(int argc, char *argv[]) {
+    int nrun = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "adhsmwi:c:e:j:r:t:C:S:W:")) != -1) {
+        if (c == 'i') {
+            fname = optarg;
+        } else if (c == 'w') {
+            if ((watchfd = inotify_init1(IN_CLOEXEC)) == -1) {
+                err(1, "inotify_init1");
+            }
+        } else if (c == 'j') {
+            if ((sched.limit = strtoul(optarg, NULL, 10)) == 0) {
+                errx(1, "invalid job count: %s", optarg);
+            }
+            initarr(&sched.pending, 64);
+            initarr(&sched.running, sched.limit);
+        } else if (c == 'W') {
+            if (strchr(optarg, '=') == NULL ||
+                strtoul(strchr(optarg, '=') + 1, NULL, 10) == 0) {
+                errx(1, "invalid weight: %s", optarg);
+            }
+            if (sched.weights.alloc == 0) {
+                initarr(&sched.weights, 8);
+            }
+            pusharr(&sched.weights, optarg);
+        } else if (c == 's') {
+            atexit(printstats);
+        } else if (c == 'm') {
+            memo = 1;
+        } else if (c == 'a') {
+            artifacts = 1;
+        } else if (c == 'd') {
+            cacheserve = 1;
+        } else if (c == 'S') {
+            servepath = optarg;
+        } else if (c == 'C') {
+            askpath = optarg;
+        } else if (c == 'e') {
+            if (memoenv.alloc == 0) {
+                initarr(&memoenv, 8);
+            }
+            pusharr(&memoenv, optarg);
+        } else if (c == 't') {
+            opentrace(optarg);
+        } else if (c == 'r') {
+            reportfile = optarg;
+            initarr(&usagearr, 64);
+        } else if (c == 'c') {
+            cachedir = optarg;
+            if (mkdir(cachedir, 0777) == -1 && errno != EEXIST) {
+                err(1, "mkdir %s", cachedir);
+            }
+        } else if (c == 'h') {
+            print_help();
+            exit(0);
+        }
+        nrun += c != 'i' && c != 'S' && c != 'C';
+    }
+    return nrun;
+}
+
+static void
+checkopts(void) {
+    if (memo && cachedir == NULL) {
+        errx(1, "-m needs a cachedir");
+    }
+    if (artifacts && cachedir == NULL) {
+        errx(1, "-a needs a cachedir");
+    }
+}
+
 static void
 print_help(void) {
     fprintf(stderr,
-            "%s: [cmd] [-i filename] [-h]"
+            "%s: [cmd] [-i filename] [-c cachedir] [-j jobs] [-W cmd=n]"
+            " [-r report] [-t trace] [-e name] [-S sock] [-C sock] [-a] [-d]"
+            " [-m] [-s] [-w] [-h]"
             "\n\tcmd<string>: execute command from the loaded script"
             "\n\t-i filename<string>: script file to load"
+            "\n\t-c cachedir<string>: keep directory listings across runs"
+            "\n\t-d: serve listings and file hashes from memory to the"
+            "\n\t\tsake processes sharing cachedir"
+            "\n\t-j jobs<int>: run up to jobs commands of independent"
+            "\n\t\tstatements at once; an empty statement waits for all"
+            "\n\t-W cmd=n<string>: a job running cmd takes n of the jobs"
+            "\n\t-r report<string>: summarise jobs on stderr, all of them"
+            "\n\t\tas tab separated values in report"
+            "\n\t-t trace<string>: write a chrome trace event timeline"
+            "\n\t-a: restore the > outputs of commands run before with"
+            "\n\t\tthe same arguments, # inputs and -e variables"
+            "\n\t-m: reuse the output of captured commands run before with"
+            "\n\t\tthe same arguments, # inputs and -e variables"
+            "\n\t-e name<string>: variable whose value is part of -a and"
+            "\n\t\t-m keys"
+            "\n\t-s: print interpreter counters and phase timings at exit"
+            "\n\t-w: stay running, re-run statements whose inputs change"
+            "\n\t-S sock<string>: keep the script parsed and run the"
+            "\n\t\tcommands of -C clients connecting to sock"
+            "\n\t-C sock<string>: have the -S server on sock run cmd,"
+            "\n\t\twith its options, or run it here if there is none"
             "\n\t-h: print this message"
             "\n",
             __progname);
@@ -349,7 +981,7 @@ addusrcmds(char **cmdbeg, size_t size) {
     if (cmdslen == 0) {
         return;
     }
-    reallocptr(&plainmk, flen + cmdslen, 1);
+    reallocptr(&plainmk, flen + cmdslen + 1, 1);
     beg = plainmk + strlen(plainmk);
     for (i = 0; i < size; ++i) {
         len = strlen(cmdbeg[i]);
@@ -370,10 +1002,11 @@ initparse(void) {
     initarr(&tokarr, 1024);
     initarr(&quotarr, 128);
 }
+#endif
 
 static char *
 itertokm(char *str, int m) {
-    static char *tok = NULL;
+    static _Thread_local char *tok = NULL;
     short ch;
     uint16_t mch;
     char *curr;
@@ -409,12 +1042,15 @@ itertokm(char *str, int m) {
     case '\'':
         tok = advance(tok, m);
         curr = tok;
-        while (*tok != '\'') {
-            if (*tok++ == '\0' && m) {
-                sigerrn(tokarr.len, "non closed litteral");
-            }
+        while (*tok != '\'' && *tok != '\0') {
+            ++tok;
+        }
+        if (*tok == '\0' && m) {
+            sigerrn(tokarr.len, "non closed litteral");
+        }
+        if (m) {
+            pusharr(&quotarr, curr);
         }
-        pusharr(&quotarr, curr);
         tok = advance(tok, m);
         break;
     case '\\':
@@ -451,40 +1087,95 @@ itertokm(char *str, int m) {
 
 static char *
 readall(const char *fname) {
+    struct stat st;
+    char *text;
     FILE *f;
 
     if ((f = fopen(fname, "r")) == NULL) {
-        err(1, "fopen %s", fname);
+        sigerr("fopen %s", fname);
     }
-    if (fseek(f, 0, SEEK_END) == -1) {
-        err(1, "fseek");
+    /* a directory opens and seeks to an end no buffer can hold */
+    if (fstat(fileno(f), &st) == 0 && S_ISDIR(st.st_mode)) {
+        errno = EISDIR;
+        failread(f, NULL, fname);
     }
-    if ((flen = ftell(f)) == (size_t)-1) {
-        err(1, "ftell");
+    if (fseek(f, 0, SEEK_END) == -1 || (flen = ftell(f)) == (size_t)-1 ||
+        fseek(f, 0, SEEK_SET) == -1) {
+        failread(f, NULL, fname);
     }
-    if (fseek(f, 0, SEEK_SET) == -1) {
-        err(1, "fseek");
-    }
-    if ((plainmk = malloc(flen + 1)) == NULL) {
+    if ((text = malloc(flen + 1)) == NULL) {
         err(1, "alloc");
     }
-    if (fread(plainmk, 1, flen, f) != flen) {
-        err(1, "fread");
+    if (fread(text, 1, flen, f) != flen) {
+        if (!ferror(f)) {
+            errno = EIO;
+        }
+        failread(f, text, fname);
     }
-    plainmk[flen] = '\0';
+    text[flen] = '\0';
+    fclose(f);
+    return text;
+}
+
+/* the library gets errno back from the failing call, not from fclose */
+static _Noreturn void
+failread(FILE *f, char *text, const char *fname) {
+    int e = errno;
+
     fclose(f);
-    return plainmk;
+    free(text);
+    errno = e;
+    sigerr("read %s", fname);
 }
 
 static void
 sigerrn(size_t n, char *msg) {
     showerrn(n, msg);
+    if (stmtjmp) {
+        longjmp(*stmtjmp, 1);
+    }
+    exit(EXIT_FAILURE);
+}
+
+static _Noreturn void
+sigerrx(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vwarnx(fmt, ap);
+    va_end(ap);
+    if (stmtjmp) {
+        longjmp(*stmtjmp, 1);
+    }
+    exit(EXIT_FAILURE);
+}
+
+static _Noreturn void
+sigerr(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vwarn(fmt, ap);
+    va_end(ap);
+    if (stmtjmp) {
+        longjmp(*stmtjmp, 1);
+    }
     exit(EXIT_FAILURE);
 }
 
+static void
+sigerrno(size_t n, const char *what) {
+    char msg[PATH_MAX + 128];
+
+    snprintf(msg, sizeof(msg), "%s: %s", what, strerror(errno));
+    sigerrn(n, msg);
+}
+
 static void
 showerrn(size_t n, char *msg) {
     char *errp = itertokm(copymk, PARSE_SKIP);
+    const char *name = fname;
+    struct Source *src;
     size_t nlines = 1;
     size_t pos;
     size_t i;
@@ -497,27 +1188,37 @@ showerrn(size_t n, char *msg) {
         errp = itertokm(NULL, PARSE_SKIP);
     }
     errend = errp;
-    errbeg = errp;
-    for (beg = copymk; beg != errp; ++beg) {
+    errbeg = copymk;
+    /* a library context holds several texts, lines count from their own */
+    for (i = srcarr ? srcarr->len : 0; i > 0; --i) {
+        src = srcarr->data[i - 1];
+        if (copymk + src->off <= errp) {
+            errbeg = copymk + src->off;
+            name = src->name;
+            break;
+        }
+    }
+    for (beg = errbeg; beg != errp; ++beg) {
         if (*beg == '\n') {
             ++nlines;
+            errbeg = beg + 1;
         }
     }
-    while (*errbeg != '\n' && errbeg != copymk) {
-        --errbeg;
-    }
     while (*errend != '\n' && *errend != '\0') {
         ++errend;
     }
     cont = *errend == '\0' ? ' ' : ':';
     *errend = '\0';
-    pos = errp - errbeg;
+    pos = errp - errbeg + 1;
     fprintf(stderr,
             "error: %s:\n"
             "  %s:%lu:%lu:\n"
             "  │%s\n"
             "  %c%*c\n",
-            msg, fname, nlines, pos, errbeg + 1, cont, (int)pos, '~');
+            msg, name, nlines, pos, errbeg, cont, (int)pos, '~');
+    if (cont == ':') {
+        *errend = '\n';
+    }
 }
 
 static char *
@@ -585,13 +1286,26 @@ memown(void *p, size_t s) {
     return res;
 }
 
+static void
+initstr(struct Str *str, char *data, size_t len) {
+    str->len = len;
+    str->hash = 0;
+    str->dtype = DT_UNKNOWN;
+    str->data = data;
+    str->rope = NULL;
+    str->share = NULL;
+    str->fsize = -1;
+    str->fmtime = -1;
+}
+
 static Str *
 copystr(struct Str *str) {
     struct Str *res = alloc(sizeof(Str));
 
-    res->hash = str->hash;
-    res->len = str->len;
-    res->data = memown(str->data, str->len);
+    memcpy(res, str, sizeof(Str));
+    res->data = memown(flatstr(str), str->len);
+    res->rope = NULL;
+    res->share = NULL;
     return res;
 }
 
@@ -601,11 +1315,13 @@ copyhlist(struct Hlist *hl) {
     struct Str *strv;
     size_t i;
 
+    flathlist(hl);
     res->len = hl->len;
     res->data = memown(hl->data, sizeof(Str) * hl->len);
     strv = res->data;
     for (i = 0; i < res->len; ++i) {
         strv[i].data = memown(strv[i].data, strv[i].len);
+        strv[i].share = NULL;
     }
     return res;
 }
@@ -623,10 +1339,12 @@ copyvlist(struct Vlist *vl) {
     res->data = memown(vl->data, vl->len * sizeof(Hlist));
     hlv = res->data;
     for (i = 0; i < vl->len; ++i) {
+        flathlist(vl->data + i);
         hlv[i].data = memown(hlv[i].data, sizeof(Str) * hlv[i].len);
         strv = hlv[i].data;
         for (j = 0; j < vl->data[i].len; ++j) {
             strv[j].data = memown(strv[j].data, strv[j].len);
+            strv[j].share = NULL;
         }
     }
     return res;
@@ -634,6 +1352,9 @@ copyvlist(struct Vlist *vl) {
 
 static void
 copyval(struct Var *dst, struct Var *v) {
+    uint64_t bytes = stats.allocbytes;
+
+    ++stats.copies;
     switch (dst->type = v->type) {
     case TYPE_STR:
         dst->val.str = copystr(v->val.str);
@@ -645,11 +1366,91 @@ copyval(struct Var *dst, struct Var *v) {
         dst->val.vlist = copyvlist(v->val.vlist);
         break;
     }
+    stats.copybytes += stats.allocbytes - bytes;
 }
 
 static void
 freestr(struct Str *str) {
-    freemem(str->data, str->len);
+    if (str->share) {
+        dropshare(str->share);
+    } else {
+        freemem(str->data, str->rope ? str->rope->size : str->len);
+    }
+    if (str->rope) {
+        freerope(str->rope);
+    }
+}
+
+static void
+freerope(struct Rope *rope) {
+    size_t i;
+
+    for (i = 0; i < rope->pre.len; ++i) {
+        freestr(rope->pre.data[i]);
+        freemem(rope->pre.data[i], sizeof(Str));
+    }
+    for (i = 0; i < rope->post.len; ++i) {
+        freestr(rope->post.data[i]);
+        freemem(rope->post.data[i], sizeof(Str));
+    }
+    freemem(rope->pre.data, rope->pre.alloc * sizeof(char *));
+    freemem(rope->post.data, rope->post.alloc * sizeof(char *));
+    freemem(rope, sizeof(Rope));
+}
+
+static void
+sharehlist(struct Hlist *hl, size_t nrefs) {
+    struct Share *share;
+    size_t size = 0;
+    size_t i;
+
+    if (hl->len == 0) {
+        return;
+    }
+    flathlist(hl);
+    for (i = 0; i < hl->len; ++i) {
+        size += hl->data[i].len;
+    }
+    share = alloc(sizeof(Share) + size);
+    share->refs = nrefs * hl->len;
+    share->size = size;
+    share->map = 0;
+    size = 0;
+    for (i = 0; i < hl->len; ++i) {
+        memcpy(share->data + size, hl->data[i].data, hl->data[i].len);
+        freestr(hl->data + i);
+        hl->data[i].data = share->data + size;
+        hl->data[i].share = share;
+        size += hl->data[i].len;
+    }
+}
+
+static void
+dropshare(struct Share *share) {
+    if (__atomic_sub_fetch(&share->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    if (share->map) {
+        munmap(share, share->map);
+    } else {
+        freemem(share, sizeof(Share) + share->size);
+    }
+}
+
+static void
+unsharestr(struct Str *str) {
+    struct Share *share = str->share;
+
+    if (share == NULL) {
+        return;
+    }
+    if (str->rope) {
+        flatstr(str);
+        return;
+    }
+    str->data = memown(str->data, str->len);
+    str->share = NULL;
+    dropshare(share);
 }
 
 static void
@@ -657,7 +1458,7 @@ freehlist(struct Hlist *hl) {
     size_t i;
 
     for (i = 0; i < hl->len; ++i) {
-        freemem(hl->data[i].data, hl->data[i].len);
+        freestr(hl->data + i);
     }
     freemem(hl->data, sizeof(Str) * hl->len);
 }
@@ -669,7 +1470,7 @@ freevlist(struct Vlist *vl) {
 
     for (i = 0; i < vl->len; ++i) {
         for (j = 0; j < vl->data[i].len; ++j) {
-            freemem(vl->data[i].data[j].data, vl->data[i].data[j].len);
+            freestr(vl->data[i].data + j);
         }
         freemem(vl->data[i].data, sizeof(Str) * vl->data[i].len);
     }
@@ -695,9 +1496,9 @@ freeval(struct Var *dst) {
 static void
 printstr(FILE *out, struct Str *str) {
     if (str->hash) {
-        fputc('#', out);
+        fputc(str->hash == HASH_OUT ? '>' : '#', out);
     }
-    fprintf(out, "\"%s\"", str->data);
+    fprintf(out, "\"%s\"", flatstr(str));
 }
 
 static void
@@ -755,17 +1556,26 @@ valfromterm(struct Var *val, char *beg) {
 
     assert(!isgrammar(beg));
 
+    /* the tokens of a library eval are not in the map */
     aliasname = searcharr(&beg, names);
-    aliasval = aliasmap.node[aliasname - chrbeg(names)];
+    aliasval.val.anon = NULL;
+    if (aliasname) {
+        aliasval = aliasmap.node[aliasname - chrbeg(names)];
+    }
 
     if (aliasval.val.anon) {
+#ifndef SAKE_LIB
+        if (currstmt) {
+            pusharr(&currstmt->reads,
+                    (void *)(uintptr_t)(aliasname - chrbeg(names)));
+        }
+#endif
         copyval(val, &aliasval);
     } else {
         val->type = TYPE_STR;
         ownstr = val->val.str = alloc(sizeof(Str));
-        len = ownstr->len = strlen(beg) + 1;
-        ownstr->hash = 0;
-        ownstr->data = alloc(len);
+        len = strlen(beg) + 1;
+        initstr(ownstr, alloc(len), len);
         memcpy(ownstr->data, beg, len);
     }
 }
@@ -774,9 +1584,7 @@ static Str *
 emptystr(void) {
     struct Str *res = alloc(sizeof(Str));
 
-    res->hash = 0;
-    res->len = 1;
-    res->data = alloc(1);
+    initstr(res, alloc(1), 1);
     res->data[0] = '\0';
 
     return res;
@@ -824,12 +1632,18 @@ hashval(struct Var *res) {
     switch (res->type) {
     case TYPE_STR:
         res->val.str->hash = 1;
+#ifndef SAKE_LIB
+        watchfile(flatstr(res->val.str), WATCH_META);
+#endif
         break;
     case TYPE_HLIST:
         strv = res->val.hlist->data;
         hlen = res->val.hlist->len;
         for (i = 0; i < hlen; ++i) {
             strv[i].hash = 1;
+#ifndef SAKE_LIB
+            watchfile(flatstr(strv + i), WATCH_META);
+#endif
         }
         break;
     case TYPE_VLIST:
@@ -840,6 +1654,9 @@ hashval(struct Var *res) {
             hlen = hlv[j].len;
             for (i = 0; i < hlen; ++i) {
                 strv[i].hash = 1;
+#ifndef SAKE_LIB
+                watchfile(flatstr(strv + i), WATCH_META);
+#endif
             }
         }
         break;
@@ -848,1240 +1665,5002 @@ hashval(struct Var *res) {
 
 static void
 exec(struct Var *expr, char **cmd) {
-    char **argv = NULL;
-    struct Str *strv;
-    struct Hlist *hlp;
-    struct Vlist *vl;
-    size_t size = 0;
-    size_t nspown = 0;
-
-    int result;
+    char *msg = "failed";
+    struct Hlist *hlv = NULL;
+#ifndef SAKE_LIB
+    uint64_t key;
+#endif
+    size_t nrows = 1;
     size_t i;
-    size_t j;
-    pid_t pid;
 
     switch (expr->type) {
     case TYPE_STR:
-        strv = expr->val.str;
-        if (strv->len == 0) {
-            break;
-        }
-        size = 2;
-        reallocptr(&argv, 2, sizeof(char *));
-        argv[0] = strv->data;
-        argv[1] = NULL;
-        if ((pid = fork()) < 0) {
-            err(1, "fork");
-        } else if (pid == 0) {
-            execvp(argv[0], argv);
-        } else {
-            if (wait(&result) == -1) {
-                err(1, "wait");
-            }
-            if (result) {
-                sigerrn(cmd - chrbeg(&tokarr), "executed command failed");
-            }
-            break;
+        if (expr->val.str->len == 0) {
+            freeval(expr);
+            return;
         }
-        break;
+        msg = "executed command failed";
+        convert(expr, TYPE_HLIST);
+        /* FALLTHROUGH */
     case TYPE_HLIST:
-        hlp = expr->val.hlist;
-        if (hlp->len == 0) {
-            break;
-        }
-        size = hlp->len + 1;
-        reallocptr(&argv, hlp->len + 1, sizeof(char *));
-        for (i = 0; i < hlp->len; ++i) {
-            argv[i] = hlp->data[i].data;
-        }
-        argv[hlp->len] = NULL;
-        if ((pid = fork()) < 0) {
-            err(1, "fork");
-        } else if (pid == 0) {
-            execvp(argv[0], argv);
-        } else {
-            if (wait(&result) == -1) {
-                err(1, "wait");
-            }
-            if (result) {
-                sigerrn(cmd - chrbeg(&tokarr), "failed");
-            }
-            break;
-        }
+        hlv = expr->val.hlist;
         break;
     case TYPE_VLIST:
-        vl = expr->val.vlist;
-        if (vl->len == 0) {
-            break;
+        hlv = expr->val.vlist->data;
+        nrows = expr->val.vlist->len;
+        break;
+    }
+    if (sched.limit && conflictjobs(expr)) {
+        waitjobs(JOB_MARKED);
+    }
+    for (i = 0; i < nrows; ++i) {
+        if (hlv[i].len == 0) {
+            continue;
         }
-        for (j = 0; j < vl->len; ++j) {
-            hlp = vl->data + j;
-            if (hlp->len == 0) {
-                continue;
-            }
-            if (size < hlp->len + 1) {
-                reallocptr(&argv, hlp->len + 1, sizeof(char *));
-                size = hlp->len + 1;
-            }
-            for (i = 0; i < hlp->len; ++i) {
-                argv[i] = hlp->data[i].data;
-            }
-            argv[hlp->len] = NULL;
-            if ((pid = fork()) < 0) {
-                err(1, "fork");
-            } else if (pid == 0) {
-                execvp(argv[0], argv);
+#ifndef SAKE_LIB
+        if (artifacts && countoutputs(hlv + i)) {
+            key = memokey(hlv + i);
+            if (restoreoutputs(key, hlv + i)) {
+                freehlist(hlv + i);
+                hlv[i].len = 0;
+                hlv[i].data = NULL;
             } else {
-                ++nspown;
-                continue;
-            }
-        }
-        for (i = 0; i < nspown; ++i) {
-            if (wait(&result) == -1) {
-                err(1, "wait");
-            }
-            if (result) {
-                sigerrn(cmd - chrbeg(&tokarr), "failed");
+                queuejob(hlv + i, cmd, msg, -1)->outkey = key;
             }
+            continue;
         }
-        break;
+#endif
+        queuejob(hlv + i, cmd, msg, -1);
+    }
+    if (sched.limit) {
+        runjobs();
+    } else {
+        waitjobs(JOB_ALL);
     }
     freeval(expr);
-    freemem(argv, size * sizeof(char *));
 }
 
-static void
-evalmk(char **toks, char **tokend) {
-    char **curr = toks;
-    char **begstat;
+static pid_t
+spawn(struct Hlist *row, char ***argv, size_t *size, int out) {
+    size_t i;
+    pid_t pid;
 
-    while (curr < tokend) {
-        begstat = curr;
-        while (*curr != litts[SYM_SEMICOL]) {
-            ++curr;
+    if (*size < row->len + 1) {
+        reallocptr(argv, row->len + 1, sizeof(char *));
+        *size = row->len + 1;
+    }
+    for (i = 0; i < row->len; ++i) {
+        (*argv)[i] = flatstr(row->data + i);
+    }
+    (*argv)[row->len] = NULL;
+    ++stats.forks;
+    if ((pid = fork()) < 0) {
+        sigerr("fork");
+    } else if (pid == 0) {
+        if (out != -1 && dup2(out, STDOUT_FILENO) == -1) {
+            warn("dup2");
+            _exit(127);
         }
-#if DEBUG
-        printtok(begstat, curr);
-#endif
-        evalstmnt(begstat, curr);
-        ++curr;
+        execvp((*argv)[0], *argv);
+        warn("execvp %s", (*argv)[0]);
+        _exit(127);
     }
+    return pid;
 }
 
-static void
-evalstmnt(char **beg, char **end) {
-    struct Var expr;
-    struct Var *aliasval;
-    char **i;
-    char **alias;
+static struct Job *
+queuejob(struct Hlist *row, char **cmd, char *msg, int out) {
+    struct Job *job = alloc(sizeof(Job));
+    struct JobTime *prev;
+    size_t i;
 
-    if (beg == end) {
-        return;
-    }
-    if (end - beg > 2 && beg[1] == litts[SYM_EQ]) {
-        if (isgrammar(*beg)) {
-            sigerrn(beg - chrbeg(&tokarr), "aliasing base symbol");
-        }
-        if (searcharr(beg, &quotarr)) {
-            sigerrn(beg - chrbeg(&tokarr), "aliasing litteral");
-        }
-        for (i = beg + 2; i < end; ++i) {
-            if (*i == litts[SYM_EQ]) {
-                sigerrn(i - chrbeg(&tokarr), "assign in expression");
-            }
-        }
-        evalexpr(&expr, beg + 2, end);
-        if ((alias = searcharr(beg, &aliasmap.namearr)) == NULL) {
-            errx(1, "BUG: non parsed alias, %s", *beg);
-        }
-        aliasval = &aliasmap.node[alias - chrbeg(&aliasmap.namearr)];
-        if (aliasval->val.anon) {
-            freeval(aliasval);
-        }
-        memcpy(aliasval, &expr, sizeof(Var));
-#if DEBUG
-        printval(&expr, *alias, OFILE_ERR);
+    memcpy(&job->args, row, sizeof(Hlist));
+    row->data = NULL;
+    row->len = 0;
+    job->cmd = cmd;
+    job->msg = msg;
+    job->pid = -1;
+    job->out = out;
+    job->outkey = 0;
+#ifndef SAKE_LIB
+    job->queued = tracenow();
+    job->seq = __atomic_fetch_add(&traceseq, 1, __ATOMIC_RELAXED);
 #endif
-        return;
+    job->marked = 0;
+    job->key = 0xcbf29ce484222325;
+    for (i = 0; i < job->args.len; ++i) {
+        job->key = (job->key ^ hashstr(job->args.data + i)) * 0x100000001b3;
+    }
+    job->bytes = jobbytes(&job->args);
+    job->weight = jobweight(&job->args);
+    job->rss = 0;
+    if ((prev = findtime(job->key)) != NULL) {
+        job->estimate = prev->ns;
+        job->rss = prev->rss;
     } else {
-        evalexpr(&expr, beg, end);
-        exec(&expr, beg);
+        job->estimate = job->bytes * history.rate;
     }
+    pusharr(&sched.pending, job);
+    return job;
 }
 
-static char **
-evalexpr(struct Var *res, char **beg, char **end) {
-    if (beg == end) {
-        sigerrn(beg - chrbeg(&tokarr), "no expression to evaluate");
-    }
-    if (isbinaryop(*beg)) {
-        sigerrn(beg - chrbeg(&tokarr), "missing left operand");
-    }
-    if ((beg = evalterm(res, beg, end)) != end) {
-        sigerrn(beg - chrbeg(&tokarr), "malformed expression");
+static size_t
+pickjob(void) {
+    struct Job **pendv = (struct Job **)sched.pending.data;
+    size_t next = 0;
+    size_t i;
+
+    /* pending jobs never depend on each other, so the longest path
+     * through what is left starts at the longest job */
+    for (i = 1; sched.limit && i < sched.pending.len; ++i) {
+        if (pendv[i]->estimate > pendv[next]->estimate) {
+            next = i;
+        }
     }
-    return beg;
+    return next;
 }
 
-static char **
-evalterm(struct Var *res, char **beg, char **end) {
-
-    assert(beg != end);
-
-    if (!isterm(*beg)) {
-        sigerrn(beg - chrbeg(&tokarr), "malformed expression");
+static int
+admitjob(struct Job *job) {
+    if (sched.running.len == 0 || sched.limit == 0) {
+        return 1;
     }
-    if (isunaryop(*beg)) {
-        beg = evalunaryop(res, beg, end);
-    } else if (*beg == litts[SYM_L_SBRACK]) {
-        beg = evalsbrack(res, beg, end);
-    } else if (*beg == litts[SYM_L_CBRACK]) {
-        beg = evalcbrack(res, beg, end);
-    } else if (*beg == litts[SYM_L_RBRACK]) {
-        beg = evalrbrack(res, beg, end);
-    } else {
-        valfromterm(res, *beg++);
+    if (sched.weight + job->weight > sched.limit) {
+        return 0;
     }
-    while (isbinaryop(*beg) && beg != end) {
-        beg = evalbinaryop(res, beg, end);
+    readload();
+    if (load.avg1 > load.ncpu || load.mempsi > PSI_LIMIT ||
+        job->rss + MEM_RESERVE > load.memavail) {
+        return 0;
     }
-    return beg;
+    return 1;
 }
 
-static char **
-evalbinaryop(struct Var *res, char **beg, char **end) {
-    struct Var rhs;
-    char *op = *beg;
-
-    assert(isbinaryop(op));
+static void
+startjob(size_t next) {
+    struct Job **pendv = (struct Job **)sched.pending.data;
+    struct Job *job = pendv[next];
+    char **argv = NULL;
+    size_t size = 0;
+    size_t i;
 
-    if (++beg == end) {
-        sigerrn(beg - chrbeg(&tokarr), "missing right operand");
-    }
-    if (isbinaryop(*beg)) {
-        sigerrn(beg - 1 - chrbeg(&tokarr), "missing right operand");
-    }
-    if (isgrammar(*beg)) {
-        beg = evalterm(&rhs, beg, end);
-    } else {
-        valfromterm(&rhs, *beg++);
+    memmove(pendv + next, pendv + next + 1,
+            (--sched.pending.len - next) * sizeof(void *));
+    for (job->slot = 0, i = 0; i < sched.running.len; ++i) {
+        if (((struct Job *)sched.running.data[i])->slot == job->slot) {
+            ++job->slot;
+            i = -1;
+        }
     }
-    execbinaryop(res, &rhs, op);
-    return beg;
+    job->start = monons();
+    job->pid = spawn(&job->args, &argv, &size, job->out);
+    job->pidfd = openpidfd(job->pid);
+    pusharr(&sched.running, job);
+    sched.weight += job->weight;
+    /* the child has not grown yet, keep its share until the next read */
+    load.memavail -= job->rss < load.memavail ? job->rss : load.memavail;
+    free(argv);
 }
 
-static char **
-evalrbrack(struct Var *res, char **beg, char **end) {
-    size_t nest = 1;
-    char **subend;
-
-    assert(*beg == litts[SYM_L_RBRACK]);
+static void
+reapjob(void) {
+    struct rusage ru;
+    struct Job *pend;
+    struct Job *job;
+    char **cmd;
+    char *msg;
+    int result;
+    size_t i;
+    pid_t pid;
 
-    subend = ++beg;
-    while (subend != end) {
-        if (*subend == litts[SYM_L_RBRACK]) {
-            ++nest;
-        } else if (*subend == litts[SYM_R_RBRACK] && --nest == 0) {
+    if ((pid = waitrunning(&result, &ru)) == -1) {
+        sigerr("wait4");
+    }
+    for (i = 0; i < sched.running.len; ++i) {
+        if (((struct Job *)sched.running.data[i])->pid == pid) {
             break;
         }
-        ++subend;
     }
-    if (*subend != litts[SYM_R_RBRACK]) {
-        sigerrn(beg - chrbeg(&tokarr), "missing closing paren");
+    if (i == sched.running.len) {
+        return;
     }
-    if (subend - beg == 0) {
-        res->type = TYPE_STR;
-        res->val.str = emptystr();
-        beg = subend;
-    } else if ((beg = evalterm(res, beg, subend)) != subend) {
-        sigerrn(beg - chrbeg(&tokarr), "incomplete expression");
+    job = sched.running.data[i];
+    if (job->pidfd != -1) {
+        close(job->pidfd);
     }
-    return beg + 1;
+    if (job->out != -1) {
+        close(job->out);
+    }
+    sched.running.data[i] = sched.running.data[--sched.running.len];
+    sched.weight -= job->weight;
+    job->rss = ru.ru_maxrss;
+#ifndef SAKE_LIB
+    if (reportfile) {
+        recordusage(job, &ru, result, monons() - job->start);
+    }
+    tracejob(job);
+    if (result == 0 && job->outkey) {
+        storeoutputs(job->outkey, &job->args);
+    }
+#endif
+    freehlist(&job->args);
+    if (result == 0) {
+        recordtime(job, monons() - job->start);
+    } else {
+        /* the jobs reaped below may fail and jump out as well */
+        cmd = job->cmd;
+        msg = job->msg;
+        free(job);
+        for (i = 0; i < sched.pending.len; ++i) {
+            pend = sched.pending.data[i];
+            if (pend->out != -1) {
+                close(pend->out);
+            }
+            freehlist(&pend->args);
+            free(pend);
+        }
+        sched.pending.len = 0;
+        if (sched.running.len) {
+            warnx("waiting for %zu running jobs", sched.running.len);
+        }
+        while (sched.running.len) {
+            reapjob();
+        }
+#ifndef SAKE_LIB
+        savehistory();
+        reportjobs();
+#endif
+        sigerrn(cmd - chrbeg(&tokarr), msg);
+    }
+    free(job);
 }
 
-static char **
-evalsbrack(struct Var *res, char **beg, char **end) {
-    size_t nest = 1;
-    char **subend;
-    struct Var ele;
+static int
+openpidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
 
-    assert(*beg == litts[SYM_L_SBRACK]);
+static pid_t
+waitrunning(int *result, struct rusage *ru) {
+    struct pollfd *pfd;
+    struct Job *job;
+    pid_t pid = -1;
+    size_t n = sched.running.len;
+    size_t i;
 
-    subend = ++beg;
-    while (subend != end) {
-        if (*subend == litts[SYM_L_SBRACK]) {
-            ++nest;
-        } else if (*subend == litts[SYM_R_SBRACK] && --nest == 0) {
-            break;
+    /* only our own children, the embedding process may have others */
+    pfd = alloc(n * sizeof(struct pollfd));
+    for (i = 0; i < n; ++i) {
+        job = sched.running.data[i];
+        if ((pfd[i].fd = job->pidfd) == -1) {
+            free(pfd);
+            return wait4(-1, result, 0, ru);
         }
-        ++subend;
+        pfd[i].events = POLLIN;
     }
-    if (*subend != litts[SYM_R_SBRACK]) {
-        sigerrn(beg - chrbeg(&tokarr), "missing closing bracket");
+    while (poll(pfd, n, -1) == -1) {
+        if (errno != EINTR) {
+            free(pfd);
+            sigerr("poll");
+        }
     }
-    res->type = TYPE_HLIST;
-    res->val.hlist = emptyhlist();
-
-    while (beg != subend) {
-        beg = evalterm(&ele, beg, subend);
-        convert(&ele, TYPE_HLIST);
-        res->val.hlist = concathlist(res->val.hlist, ele.val.hlist);
+    for (i = 0; i < n; ++i) {
+        if (pfd[i].revents) {
+            pid = ((struct Job *)sched.running.data[i])->pid;
+            break;
+        }
     }
-    return beg + 1;
+    free(pfd);
+    return wait4(pid, result, 0, ru);
 }
 
-static char **
-evalcbrack(struct Var *res, char **beg, char **end) {
-    size_t nest = 1;
-    char **subend;
-
-    assert(*beg == litts[SYM_L_CBRACK]);
+static void
+runjobs(void) {
+    size_t next;
 
-    subend = ++beg;
-    while (subend != end && *subend) {
-        if (*subend == litts[SYM_L_CBRACK]) {
-            ++nest;
-        } else if (*subend == litts[SYM_R_CBRACK] && --nest == 0) {
+    while (sched.pending.len) {
+        next = pickjob();
+        if (!admitjob(sched.pending.data[next])) {
             break;
         }
-        ++subend;
-    }
-    if (*subend != litts[SYM_R_CBRACK]) {
-        sigerrn(beg - chrbeg(&tokarr), "missing closing bracket");
-    }
-    res->type = TYPE_VLIST;
-    res->val.vlist = emptyvlist();
-    struct Var ele;
-    while (beg != subend) {
-        beg = evalterm(&ele, beg, subend);
-        convert(&ele, TYPE_VLIST);
-        res->val.vlist = concatvlist(res->val.vlist, ele.val.vlist);
+        startjob(next);
     }
-    return beg + 1;
 }
 
-static char **
-evalunaryop(struct Var *res, char **beg, char **end) {
-    char *op = *beg;
-    char **cmd;
+static void
+waitjobs(enum JOB until) {
+    size_t nmarked;
+    size_t i;
 
-    assert(isunaryop(op));
+    for (;;) {
+        runjobs();
+        nmarked = 0;
+        for (i = 0; until == JOB_MARKED && i < sched.pending.len; ++i) {
+            nmarked += ((struct Job *)sched.pending.data[i])->marked;
+        }
+        for (i = 0; until == JOB_MARKED && i < sched.running.len; ++i) {
+            nmarked += ((struct Job *)sched.running.data[i])->marked;
+        }
+        if (sched.running.len == 0 ||
+            (until == JOB_MARKED && nmarked == 0)) {
+            return;
+        }
+        reapjob();
+    }
+}
 
-    if ((cmd = ++beg) == end) {
-        sigerrn(beg - chrbeg(&tokarr), "missing argument");
+static size_t
+conflictjobs(struct Var *expr) {
+    struct Hlist files = { 0, NULL };
+    struct Hlist *hlv;
+    struct Arr *queues[] = { &sched.pending, &sched.running };
+    struct Job *job;
+    struct Set set;
+    size_t nmarked = 0;
+    size_t nrows = 1;
+    size_t i;
+    size_t j;
+    size_t q;
+
+    if (sched.pending.len + sched.running.len == 0) {
+        return 0;
     }
-    if (isgrammar(*beg)) {
-        beg = evalterm(res, beg, end);
+    if (expr->type == TYPE_HLIST) {
+        hlv = expr->val.hlist;
     } else {
-        valfromterm(res, *beg++);
+        hlv = expr->val.vlist->data;
+        nrows = expr->val.vlist->len;
+    }
+    for (i = 0; i < nrows; ++i) {
+        for (j = 0; j < hlv[i].len; ++j) {
+            if (hlv[i].data[j].hash) {
+                reallocptr(&files.data, files.len + 1, sizeof(Str));
+                memcpy(files.data + files.len++, hlv[i].data + j,
+                       sizeof(Str));
+            }
+        }
+    }
+    if (files.len == 0) {
+        return 0;
+    }
+    setfromhlist(&set, &files);
+    for (q = 0; q < 2; ++q) {
+        for (i = 0; i < queues[q]->len; ++i) {
+            job = queues[q]->data[i];
+            /* an earlier job may write what we read without marking it */
+            for (j = 0; !job->marked && j < job->args.len; ++j) {
+                job->marked = insetstr(&set, job->args.data + j);
+            }
+            nmarked += job->marked;
+        }
     }
+    freeset(&set);
+    free(files.data);
+    return nmarked;
+}
 
-    if (op == litts[SYM_HASH]) {
-        hashval(res);
-    } else if (op == litts[SYM_LESS]) {
-        printval(res, NULL, OFILE_OUT);
-    } else if (op == litts[SYM_AT]) {
-        atval(res, cmd);
-    } else {
-        assert("BUG: unimplemented");
+static int
+needsbarrier(char **beg, char **end) {
+    if (beg == end) {
+        return 1;
     }
-    return beg;
+    for (; beg != end; ++beg) {
+        if (*beg == litts[SYM_AT] || *beg == litts[SYM_ATAT] ||
+            *beg == litts[SYM_DOL] || *beg == litts[SYM_DOLDOL]) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
-static void
-initarr(struct Arr *arr, size_t all) {
-    arr->data = NULL;
-    reallocptr(&arr->data, all, sizeof(char *));
-    arr->alloc = all;
-    arr->len = 0;
+static int64_t
+monons(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-static void
-pusharr(struct Arr *arr, void *d) {
-    reallocarr(arr, 1);
-    arr->data[arr->len++] = d;
+static uint64_t
+jobbytes(struct Hlist *args) {
+    struct statx stx;
+    uint64_t bytes = 0;
+    size_t i;
+
+    for (i = 0; i < args->len; ++i) {
+        /* > outputs are not there yet or left from a run before */
+        if (args->data[i].hash != 1) {
+            continue;
+        }
+        if (args->data[i].fsize >= 0) {
+            bytes += args->data[i].fsize;
+        } else if (statx(AT_FDCWD, flatstr(args->data + i), 0, STATX_SIZE,
+                         &stx) != -1) {
+            bytes += stx.stx_size;
+        }
+    }
+    return bytes;
 }
 
-static void
-reallocarr(struct Arr *arr, size_t n) {
-    if (arr->len == arr->alloc) {
-        arr->alloc += arr->alloc / 2 + n;
-        reallocptr(&arr->data, arr->alloc, sizeof(char *));
+static struct JobTime *
+findtime(uint64_t key) {
+    struct JobTime k = { .key = key };
+
+    if (history.len == 0) {
+        return NULL;
     }
+    return bsearch(&k, history.data, history.len, sizeof(JobTime), sorttime);
 }
 
 static void
-shrinkarr(struct Arr *arr) {
-    reallocptr(&arr->data, arr->len, sizeof(char *));
-    arr->alloc = arr->len;
+recordtime(struct Job *job, int64_t ns) {
+    struct JobTime *prev;
+    size_t i;
+
+    history.dirty = 1;
+    if ((prev = findtime(job->key)) != NULL) {
+        prev->ns = ns;
+        prev->bytes = job->bytes;
+        prev->rss = job->rss;
+        return;
+    }
+    reallocptr(&history.data, history.len + 1, sizeof(JobTime));
+    for (i = history.len++; i > 0 && history.data[i - 1].key > job->key;
+         --i) {
+        history.data[i] = history.data[i - 1];
+    }
+    history.data[i].key = job->key;
+    history.data[i].ns = ns;
+    history.data[i].bytes = job->bytes;
+    history.data[i].rss = job->rss;
 }
 
-static void
-copymkarr(struct Arr *dst, struct Arr *src) {
-    if (dst->alloc < src->len) {
-        reallocptr(&dst->data, src->len, sizeof(char *));
-        dst->alloc = src->len;
+static size_t
+jobweight(struct Hlist *args) {
+    char *name = flatstr(args->data);
+    char *w;
+    size_t i;
+
+    if (strrchr(name, '/')) {
+        name = strrchr(name, '/') + 1;
     }
-    memcpy(dst->data, src->data, src->len * sizeof(char *));
-    dst->len = src->len;
+    for (i = 0; i < sched.weights.len; ++i) {
+        w = sched.weights.data[i];
+        if (strncmp(w, name, strlen(name)) == 0 && w[strlen(name)] == '=') {
+            return strtoul(w + strlen(name) + 1, NULL, 10);
+        }
+    }
+    return 1;
 }
 
 static void
-sortstrarr(Arr *arr) {
-    qsort(arr->data, arr->len, sizeof(char *), sortstr);
-}
+readload(void) {
+    char line[128];
+    int64_t now = monons();
+    unsigned long long kb;
+    FILE *f;
 
-static char **
-searcharr(char **k, Arr *arr) {
-    return bsearch(k, arr->data, arr->len, sizeof(char *), sortstr);
+    if (load.at && now - load.at < LOAD_REFRESH) {
+        return;
+    }
+    load.at = now;
+    if (load.ncpu == 0 && (load.ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+        load.ncpu = 1;
+    }
+    load.avg1 = 0;
+    load.mempsi = 0;
+    load.memavail = UINT64_MAX;
+    if ((f = fopen("/proc/loadavg", "r")) != NULL) {
+        if (fscanf(f, "%lf", &load.avg1) != 1) {
+            load.avg1 = 0;
+        }
+        fclose(f);
+    }
+    if ((f = fopen("/proc/pressure/memory", "r")) != NULL) {
+        if (fscanf(f, "some avg10=%lf", &load.mempsi) != 1) {
+            load.mempsi = 0;
+        }
+        fclose(f);
+    }
+    if ((f = fopen("/proc/meminfo", "r")) != NULL) {
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+                load.memavail = kb;
+                break;
+            }
+        }
+        fclose(f);
+    }
 }
 
 static int
-sortstr(const void *f, const void *s) {
-    return strcmp(*(char **)f, *(char **)s);
+sorttime(const void *f, const void *s) {
+    uint64_t fk = ((struct JobTime *)f)->key;
+    uint64_t sk = ((struct JobTime *)s)->key;
+
+    return (fk > sk) - (fk < sk);
 }
 
+#ifndef SAKE_LIB
 static void
-uniqarr(struct Arr *arr) {
-    char **beg = chrbeg(arr);
-    char **end = chrend(arr);
-    char **dup = beg;
+loadhistory(void) {
+    size_t len = cachedir ? strlen(cachedir) + 8 : 0;
+    double ns = 0;
+    double bytes = 0;
+    uint64_t magic;
+    char *path;
+    struct stat st;
+    size_t i;
+    FILE *f;
 
-    while (dup != end) {
-        while (strcmp(*dup, *beg) == 0) {
-            if (++dup == end) {
+    history.rate = 1;
+    if (cachedir == NULL) {
+        return;
+    }
+    path = alloc(len);
+    snprintf(path, len, "%s/jobs", cachedir);
+    f = fopen(path, "r");
+    free(path);
+    if (f == NULL) {
+        return;
+    }
+    if (fstat(fileno(f), &st) == -1 || (size_t)st.st_size < sizeof(magic) ||
+        (st.st_size - sizeof(magic)) % sizeof(JobTime) ||
+        fread(&magic, sizeof(magic), 1, f) != 1 || magic != HISTORY_MAGIC) {
+        fclose(f);
+        return;
+    }
+    history.len = (st.st_size - sizeof(magic)) / sizeof(JobTime);
+    history.data = alloc(history.len * sizeof(JobTime));
+    if (fread(history.data, sizeof(JobTime), history.len, f) != history.len) {
+        history.len = 0;
+    }
+    fclose(f);
+    for (i = 0; i < history.len; ++i) {
+        ns += history.data[i].ns;
+        bytes += history.data[i].bytes;
+    }
+    if (bytes > 0) {
+        history.rate = ns / bytes;
+    }
+}
+
+static void
+savehistory(void) {
+    uint64_t magic = HISTORY_MAGIC;
+    char *path;
+    char *tmp;
+    FILE *f;
+    int fd;
+
+    if (cachedir == NULL || !history.dirty) {
+        return;
+    }
+    history.dirty = 0;
+    path = alloc(strlen(cachedir) + 8);
+    sprintf(path, "%s/jobs", cachedir);
+    tmp = alloc(strlen(path) + 8);
+    sprintf(tmp, "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) == -1 || (f = fdopen(fd, "w")) == NULL) {
+        warn("%s", tmp);
+        free(path);
+        free(tmp);
+        return;
+    }
+    fwrite(&magic, sizeof(magic), 1, f);
+    fwrite(history.data, sizeof(JobTime), history.len, f);
+    if (fclose(f) == EOF || rename(tmp, path) == -1) {
+        warn("%s", path);
+        unlink(tmp);
+    }
+    free(path);
+    free(tmp);
+}
+#endif
+
+static void
+evalmk(char **toks, char **tokend) {
+    char **curr = toks;
+    char **begstat;
+#ifndef SAKE_LIB
+    int64_t t0;
+#endif
+
+    while (curr < tokend) {
+        begstat = curr;
+        while (*curr != litts[SYM_SEMICOL]) {
+            ++curr;
+        }
+#if DEBUG
+        printtok(begstat, curr);
+#endif
+#ifndef SAKE_LIB
+        t0 = tracenow();
+        evalstmnt(begstat, curr);
+        tracestmt(begstat, curr, t0);
+#else
+        evalstmnt(begstat, curr);
+#endif
+        ++curr;
+    }
+    waitjobs(JOB_ALL);
+#ifndef SAKE_LIB
+    savehistory();
+    reportjobs();
+#endif
+}
+
+static void
+evalstmnt(char **beg, char **end) {
+    struct Var expr;
+    struct Var *aliasval;
+    char **i;
+    char **alias;
+
+    if (sched.limit && needsbarrier(beg, end)) {
+        waitjobs(JOB_ALL);
+    }
+    if (beg == end) {
+        return;
+    }
+    if (end - beg > 2 && beg[1] == litts[SYM_EQ]) {
+        if (isgrammar(*beg)) {
+            sigerrn(beg - chrbeg(&tokarr), "aliasing base symbol");
+        }
+        if (searcharr(beg, &quotarr)) {
+            sigerrn(beg - chrbeg(&tokarr), "aliasing litteral");
+        }
+        for (i = beg + 2; i < end; ++i) {
+            if (*i == litts[SYM_EQ]) {
+                sigerrn(i - chrbeg(&tokarr), "assign in expression");
+            }
+        }
+        evalexpr(&expr, beg + 2, end);
+        if ((alias = searcharr(beg, &aliasmap.namearr)) == NULL) {
+            errx(1, "BUG: non parsed alias, %s", *beg);
+        }
+        aliasval = &aliasmap.node[alias - chrbeg(&aliasmap.namearr)];
+        if (aliasval->val.anon) {
+            freeval(aliasval);
+        }
+        memcpy(aliasval, &expr, sizeof(Var));
+#if DEBUG
+        printval(&expr, *alias, OFILE_ERR);
+#endif
+        return;
+    } else {
+        evalexpr(&expr, beg, end);
+        exec(&expr, beg);
+    }
+}
+
+static char **
+evalexpr(struct Var *res, char **beg, char **end) {
+    if (beg == end) {
+        sigerrn(beg - chrbeg(&tokarr), "no expression to evaluate");
+    }
+    if (isbinaryop(*beg)) {
+        sigerrn(beg - chrbeg(&tokarr), "missing left operand");
+    }
+    if ((beg = evalterm(res, beg, end)) != end) {
+        sigerrn(beg - chrbeg(&tokarr), "malformed expression");
+    }
+    return beg;
+}
+
+static char **
+evalterm(struct Var *res, char **beg, char **end) {
+
+    assert(beg != end);
+
+    if (!isterm(*beg)) {
+        sigerrn(beg - chrbeg(&tokarr), "malformed expression");
+    }
+    if (isunaryop(*beg)) {
+        beg = evalunaryop(res, beg, end);
+    } else if (*beg == litts[SYM_L_SBRACK]) {
+        beg = evalsbrack(res, beg, end);
+    } else if (*beg == litts[SYM_L_CBRACK]) {
+        beg = evalcbrack(res, beg, end);
+    } else if (*beg == litts[SYM_L_RBRACK]) {
+        beg = evalrbrack(res, beg, end);
+    } else {
+        valfromterm(res, *beg++);
+    }
+    while (isbinaryop(*beg) && beg != end) {
+        beg = evalbinaryop(res, beg, end);
+    }
+    return beg;
+}
+
+static char **
+evalbinaryop(struct Var *res, char **beg, char **end) {
+    struct Var rhs;
+    char **op = beg;
+
+    assert(isbinaryop(*op));
+
+    if (++beg == end) {
+        sigerrn(beg - chrbeg(&tokarr), "missing right operand");
+    }
+    if (isbinaryop(*beg)) {
+        sigerrn(beg - 1 - chrbeg(&tokarr), "missing right operand");
+    }
+    if (isgrammar(*beg)) {
+        beg = evalterm(&rhs, beg, end);
+    } else {
+        valfromterm(&rhs, *beg++);
+    }
+    execbinaryop(res, &rhs, op);
+    return beg;
+}
+
+static char **
+evalrbrack(struct Var *res, char **beg, char **end) {
+    size_t nest = 1;
+    char **subend;
+
+    assert(*beg == litts[SYM_L_RBRACK]);
+
+    subend = ++beg;
+    while (subend != end) {
+        if (*subend == litts[SYM_L_RBRACK]) {
+            ++nest;
+        } else if (*subend == litts[SYM_R_RBRACK] && --nest == 0) {
+            break;
+        }
+        ++subend;
+    }
+    if (*subend != litts[SYM_R_RBRACK]) {
+        sigerrn(beg - chrbeg(&tokarr), "missing closing paren");
+    }
+    if (subend - beg == 0) {
+        res->type = TYPE_STR;
+        res->val.str = emptystr();
+        beg = subend;
+    } else if ((beg = evalterm(res, beg, subend)) != subend) {
+        sigerrn(beg - chrbeg(&tokarr), "incomplete expression");
+    }
+    return beg + 1;
+}
+
+static char **
+evalsbrack(struct Var *res, char **beg, char **end) {
+    size_t nest = 1;
+    char **subend;
+    struct Var ele;
+
+    assert(*beg == litts[SYM_L_SBRACK]);
+
+    subend = ++beg;
+    while (subend != end) {
+        if (*subend == litts[SYM_L_SBRACK]) {
+            ++nest;
+        } else if (*subend == litts[SYM_R_SBRACK] && --nest == 0) {
+            break;
+        }
+        ++subend;
+    }
+    if (*subend != litts[SYM_R_SBRACK]) {
+        sigerrn(beg - chrbeg(&tokarr), "missing closing bracket");
+    }
+    res->type = TYPE_HLIST;
+    res->val.hlist = emptyhlist();
+
+    while (beg != subend) {
+        beg = evalterm(&ele, beg, subend);
+        convert(&ele, TYPE_HLIST);
+        res->val.hlist = concathlist(res->val.hlist, ele.val.hlist);
+    }
+    return beg + 1;
+}
+
+static char **
+evalcbrack(struct Var *res, char **beg, char **end) {
+    size_t nest = 1;
+    char **subend;
+
+    assert(*beg == litts[SYM_L_CBRACK]);
+
+    subend = ++beg;
+    while (subend != end && *subend) {
+        if (*subend == litts[SYM_L_CBRACK]) {
+            ++nest;
+        } else if (*subend == litts[SYM_R_CBRACK] && --nest == 0) {
+            break;
+        }
+        ++subend;
+    }
+    if (*subend != litts[SYM_R_CBRACK]) {
+        sigerrn(beg - chrbeg(&tokarr), "missing closing bracket");
+    }
+    res->type = TYPE_VLIST;
+    res->val.vlist = emptyvlist();
+    struct Var ele;
+    while (beg != subend) {
+        beg = evalterm(&ele, beg, subend);
+        convert(&ele, TYPE_VLIST);
+        res->val.vlist = concatvlist(res->val.vlist, ele.val.vlist);
+    }
+    return beg + 1;
+}
+
+static char **
+evalunaryop(struct Var *res, char **beg, char **end) {
+    char *op = *beg;
+    char **cmd;
+
+    assert(isunaryop(op));
+
+    if ((cmd = ++beg) == end) {
+        sigerrn(beg - chrbeg(&tokarr), "missing argument");
+    }
+    if (isgrammar(*beg)) {
+        beg = evalterm(res, beg, end);
+    } else {
+        valfromterm(res, *beg++);
+    }
+
+    if (op == litts[SYM_HASH]) {
+        hashval(res);
+    } else if (op == litts[SYM_LESS]) {
+        printval(res, NULL, OFILE_OUT);
+    } else if (op == litts[SYM_GREAT]) {
+        outval(res);
+    } else if (op == litts[SYM_AT]) {
+        atval(res, cmd, STAT_SKIP);
+    } else if (op == litts[SYM_ATAT]) {
+        atval(res, cmd, STAT_FETCH);
+    } else if (op == litts[SYM_DOL]) {
+        capval(res, cmd, SPLIT_WORDS);
+    } else if (op == litts[SYM_DOLDOL]) {
+        capval(res, cmd, SPLIT_LINES);
+    } else {
+        assert("BUG: unimplemented");
+    }
+    return beg;
+}
+
+static void
+initarr(struct Arr *arr, size_t all) {
+    arr->data = NULL;
+    reallocptr(&arr->data, all, sizeof(char *));
+    arr->alloc = all;
+    arr->len = 0;
+}
+
+static void
+pusharr(struct Arr *arr, void *d) {
+    reallocarr(arr, 1);
+    arr->data[arr->len++] = d;
+}
+
+static void
+reallocarr(struct Arr *arr, size_t n) {
+    if (arr->len == arr->alloc) {
+        arr->alloc += arr->alloc / 2 + n;
+        reallocptr(&arr->data, arr->alloc, sizeof(char *));
+    }
+}
+
+static void
+shrinkarr(struct Arr *arr) {
+    reallocptr(&arr->data, arr->len, sizeof(char *));
+    arr->alloc = arr->len;
+}
+
+static void
+copymkarr(struct Arr *dst, struct Arr *src) {
+    if (dst->alloc < src->len) {
+        reallocptr(&dst->data, src->len, sizeof(char *));
+        dst->alloc = src->len;
+    }
+    memcpy(dst->data, src->data, src->len * sizeof(char *));
+    dst->len = src->len;
+}
+
+static void
+sortstrarr(Arr *arr) {
+    qsort(arr->data, arr->len, sizeof(char *), sortstr);
+}
+
+static char **
+searcharr(char **k, Arr *arr) {
+    ++stats.searches;
+    return bsearch(k, arr->data, arr->len, sizeof(char *), sortstr);
+}
+
+static int
+sortstr(const void *f, const void *s) {
+    return strcmp(*(char **)f, *(char **)s);
+}
+
+static void
+uniqarr(struct Arr *arr) {
+    char **beg = chrbeg(arr);
+    char **end = chrend(arr);
+    char **dup = beg;
+
+    while (dup != end) {
+        while (strcmp(*dup, *beg) == 0) {
+            if (++dup == end) {
                 return;
             }
         }
-        if (++beg == end) {
-            break;
+        if (++beg == end) {
+            break;
+        }
+        *beg = *dup;
+    }
+    arr->len = beg - chrbeg(arr);
+    shrinkarr(arr);
+}
+
+static void
+mapfromarr(struct Map *map, struct Arr *arr) {
+    initarr(&map->namearr, 0);
+    copymkarr(&map->namearr, arr);
+    sortstrarr(&map->namearr);
+    uniqarr(&map->namearr);
+    if ((map->node = calloc(map->namearr.len, sizeof(Var))) == NULL) {
+        err(1, "alloc");
+    }
+}
+
+static void *
+alloc(size_t s) {
+    void *res;
+
+    ++stats.allocs;
+    stats.allocbytes += s;
+    if ((res = malloc(s)) == NULL) {
+        err(1, "alloc");
+    }
+    return res;
+}
+
+static void
+reallocptr(void *p, size_t nmemb, size_t size) {
+    void **ptr = p;
+    size_t nsize = nmemb * size;
+
+    if (nmemb && size && SIZE_MAX / nmemb < size) {
+        errno = ENOMEM;
+        err(1, "alloc");
+    }
+    ++stats.reallocs;
+    stats.reallocbytes += nsize;
+    if ((*ptr = realloc(*ptr, nsize)) == NULL && nsize) {
+        err(1, "alloc");
+    }
+}
+
+static struct Str *
+strfromhlist(struct Hlist *hl) {
+    size_t len = 0;
+    struct Str *str;
+    char *beg;
+    size_t i;
+
+    for (i = 0; i < hl->len; ++i) {
+        len += hl->data[i].len;
+    }
+    len = len - hl->len + 1;
+    str = alloc(sizeof(Str));
+    initstr(str, alloc(len), len);
+    beg = str->data;
+    for (i = 0; i < hl->len; ++i) {
+        beg = writestr(beg, hl->data + i);
+    }
+    *beg = '\0';
+    freehlist(hl);
+    freemem(hl, sizeof(Hlist));
+    return str;
+}
+
+static struct Str *
+strfromvlist(struct Vlist *vl) {
+    struct Hlist *curr;
+    struct Str *str;
+    char *beg;
+    size_t len = 0;
+    size_t i;
+    size_t j;
+
+    for (j = 0; j < vl->len; ++j) {
+        curr = vl->data + j;
+        for (i = 0; i < curr->len; ++i) {
+            len += curr->data[i].len;
+        }
+        len = len - curr->len + 1;
+    }
+    str = alloc(sizeof(Str));
+    initstr(str, alloc(len), len);
+    beg = str->data;
+    for (j = 0; j < vl->len; ++j) {
+        curr = vl->data + j;
+        for (i = 0; i < curr->len; ++i) {
+            beg = writestr(beg, curr->data + i);
+        }
+    }
+    *beg = '\0';
+    freevlist(vl);
+    freemem(vl, sizeof(Vlist));
+    return str;
+}
+
+static struct Vlist *
+vlistfromhlist(struct Hlist *hl) {
+    struct Str *strbeg = hl->data;
+    struct Hlist *hlv = alloc(hl->len * sizeof(Hlist));
+    struct Vlist *vl = (struct Vlist *)hl;
+    size_t i;
+
+    for (i = 0; i < hl->len; ++i) {
+        hlv[i].len = 1;
+        hlv[i].data = memown(strbeg + i, sizeof(Str));
+    }
+    vl->data = hlv;
+    freemem(strbeg, hl->len * sizeof(Str));
+    return vl;
+}
+
+static struct Hlist *
+hlistfromstr(struct Str *s) {
+    struct Hlist *hl = alloc(sizeof(Hlist));
+
+    hl->len = 1;
+    hl->data = s;
+
+    return hl;
+}
+
+static struct Vlist *
+vlistfromstr(struct Str *s) {
+    struct Vlist *vl = alloc(sizeof(Vlist));
+
+    vl->len = 1;
+    vl->data = alloc(sizeof(Hlist));
+    vl->data[0].len = 1;
+    vl->data[0].data = s;
+    return vl;
+}
+
+static struct Hlist *
+hlistfromvlist(struct Vlist *vl) {
+    size_t vlen = vl->len;
+    size_t len = 0;
+    struct Hlist *hlv = vl->data;
+    struct Hlist *hl = (struct Hlist *)vl;
+    struct Str *beg;
+    size_t i;
+
+    for (i = 0; i < vlen; ++i) {
+        len += hlv[i].len;
+    }
+    hl->len = len;
+    hl->data = alloc(sizeof(Str) * len);
+    beg = hl->data;
+
+    for (i = 0; i < vlen; ++i) {
+        memcpy(beg, hlv[i].data, sizeof(Str) * hlv[i].len);
+        beg += hlv[i].len;
+    }
+    for (i = 0; i < vlen; ++i) {
+        freemem(hlv[i].data, hlv[i].len * sizeof(Str));
+    }
+    freemem(hlv, sizeof(Hlist));
+    return hl;
+}
+
+static void
+convert(struct Var *from, enum TYPE totype) {
+    ++stats.converts[from->type][totype];
+    if (from->type == totype) {
+        return;
+    }
+    switch (from->type) {
+    case TYPE_STR:
+        if (totype == TYPE_HLIST) {
+            from->val.hlist = hlistfromstr(from->val.str);
+        } else if (totype == TYPE_VLIST) {
+            from->val.vlist = vlistfromstr(from->val.str);
+        } else {
+            assert("BUG: unreacheble");
+        }
+        break;
+    case TYPE_HLIST:
+        if (totype == TYPE_STR) {
+            from->val.str = strfromhlist(from->val.hlist);
+        } else if (totype == TYPE_VLIST) {
+            from->val.vlist = vlistfromhlist(from->val.hlist);
+        } else {
+            assert("BUG: unreacheble");
+        }
+        break;
+    case TYPE_VLIST:
+        if (totype == TYPE_STR) {
+            from->val.str = strfromvlist(from->val.vlist);
+        } else if (totype == TYPE_HLIST) {
+            from->val.hlist = hlistfromvlist(from->val.vlist);
+        } else {
+            assert("BUG: unreacheble");
+        }
+        break;
+    }
+    from->type = totype;
+}
+
+static void
+appendstr(struct Str *f, struct Str *s) {
+    ropestr(f, copystr(s), POS_END);
+}
+
+static void
+prepend(struct Str *f, struct Str *s) {
+    ropestr(f, copystr(s), POS_BEG);
+}
+
+static void
+ropestr(struct Str *f, struct Str *s, enum POS pos) {
+    short hash = f->hash & s->hash;
+    struct Rope *rope;
+
+    if (s->len == 0) {
+        freestr(s);
+    } else if (f->len == 0) {
+        freestr(f);
+        memcpy(f, s, sizeof(Str));
+    } else {
+        if ((rope = f->rope) == NULL) {
+            rope = f->rope = alloc(sizeof(Rope));
+            initarr(&rope->pre, 0);
+            initarr(&rope->post, 0);
+            rope->size = f->len;
+        }
+        pusharr(pos == POS_BEG ? &rope->pre : &rope->post, s);
+        f->len += s->len - 1;
+        f->hash = hash;
+        return;
+    }
+    f->hash = hash;
+    freemem(s, sizeof(Str));
+}
+
+static char *
+writestr(char *dst, struct Str *s) {
+    struct Rope *rope = s->rope;
+    size_t i;
+
+    if (rope == NULL) {
+        if (s->len) {
+            memcpy(dst, s->data, s->len - 1);
+            dst += s->len - 1;
+        }
+        return dst;
+    }
+    for (i = rope->pre.len; i > 0; --i) {
+        dst = writestr(dst, rope->pre.data[i - 1]);
+    }
+    memcpy(dst, s->data, rope->size - 1);
+    dst += rope->size - 1;
+    for (i = 0; i < rope->post.len; ++i) {
+        dst = writestr(dst, rope->post.data[i]);
+    }
+    return dst;
+}
+
+static char *
+flatstr(struct Str *s) {
+    char *data;
+
+    if (s->rope == NULL) {
+        return s->data;
+    }
+    data = alloc(s->len);
+    *writestr(data, s) = '\0';
+    freestr(s);
+    s->rope = NULL;
+    s->share = NULL;
+    return s->data = data;
+}
+
+static void
+flathlist(struct Hlist *hl) {
+    size_t i;
+
+    for (i = 0; i < hl->len; ++i) {
+        flatstr(hl->data + i);
+    }
+}
+
+static struct Str *
+addstrstr(struct Str *f, struct Str *s) {
+    ropestr(f, s, POS_END);
+    return f;
+}
+
+static struct Hlist *
+addstrhlist(struct Str *f, struct Hlist *s) {
+    struct Str *str = s->data;
+
+    if (s->len == 0) {
+        s->data = f;
+        s->len = 1;
+        freemem(f, sizeof(Str));
+        return s;
+    }
+
+    ropestr(str, f, POS_BEG);
+    return s;
+}
+
+static struct Vlist *
+addstrvlist(struct Str *f, struct Vlist *s) {
+    struct RowOp op = { .vl = s, .str = f };
+
+    if (f->len == 0) {
+        freemem(f, sizeof(Str));
+        return s;
+    }
+    flatstr(f);
+    parrows(s->len, addstrvlistrows, &op);
+    freestr(f);
+    freemem(f, sizeof(Str));
+    return s;
+}
+
+static void
+addstrvlistrows(void *arg, size_t beg, size_t end) {
+    struct RowOp *op = arg;
+    struct Hlist *hlv = op->vl->data;
+    size_t i;
+
+    for (i = beg; i < end; ++i) {
+        prepend(hlv[i].data, op->str);
+    }
+}
+
+static struct Hlist *
+addhlisthlist(struct Hlist *f, struct Hlist *s) {
+    size_t len = f->len + s->len;
+
+    if (f->len == 0) {
+        freemem(f, sizeof(Hlist));
+        return s;
+    }
+    reallocptr(&f->data, len, sizeof(Str));
+    memcpy(f->data + f->len, s->data, s->len * sizeof(Str));
+    f->len = len;
+    freemem(s->data, s->len * sizeof(Str));
+    freemem(s, sizeof(Hlist));
+    return f;
+}
+
+static struct Vlist *
+addhlistvlist(struct Hlist *f, struct Vlist *s) {
+    struct RowOp op = { .vl = s, .hl = f };
+
+    if (s->len == 0) {
+        s->len = 1;
+        s->data = f;
+        return s;
+    }
+    sharehlist(f, s->len + 1);
+    parrows(s->len, addhlistvlistrows, &op);
+    freehlist(f);
+    freemem(f, sizeof(Hlist));
+    return s;
+}
+
+static void
+addhlistvlistrows(void *arg, size_t beg, size_t end) {
+    struct RowOp *op = arg;
+    struct Hlist *hlv = op->vl->data;
+    struct Hlist *f = op->hl;
+    size_t i;
+
+    for (i = beg; i < end; ++i) {
+        reallocptr(&hlv[i].data, hlv[i].len + f->len, sizeof(Str));
+        memmove(hlv[i].data + f->len, hlv[i].data, hlv[i].len * sizeof(Str));
+        memcpy(hlv[i].data, f->data, f->len * sizeof(Str));
+        hlv[i].len += f->len;
+    }
+}
+
+static struct Vlist *
+addvlisthlist(struct Vlist *s, struct Hlist *f) {
+    struct RowOp op = { .vl = s, .hl = f };
+
+    if (s->len == 0) {
+        s->len = 1;
+        s->data = f;
+        return s;
+    }
+    sharehlist(f, s->len + 1);
+    parrows(s->len, addvlisthlistrows, &op);
+    freehlist(f);
+    freemem(f, sizeof(Hlist));
+    return s;
+}
+
+static void
+addvlisthlistrows(void *arg, size_t beg, size_t end) {
+    struct RowOp *op = arg;
+    struct Hlist *hlv = op->vl->data;
+    struct Hlist *f = op->hl;
+    size_t i;
+    size_t nlen;
+
+    for (i = beg; i < end; ++i) {
+        nlen = hlv[i].len + f->len;
+        reallocptr(&hlv[i].data, nlen, sizeof(Str));
+        memcpy(hlv[i].data + hlv[i].len, f->data, f->len * sizeof(Str));
+        hlv[i].len = nlen;
+    }
+}
+
+static struct Vlist *
+addvlistvlist(struct Vlist *f, struct Vlist *s) {
+    struct Hlist *fhlv;
+    struct Hlist *shlv;
+    struct Str *strv;
+    size_t i;
+    size_t minlen;
+    size_t nhlen;
+    size_t vdiff;
+
+    if (f->len == 0) {
+        freemem(f, sizeof(Vlist));
+        return s;
+    }
+    if (s->len == 0) {
+        freemem(s, sizeof(Vlist));
+        return f;
+    }
+    if (f->len < s->len) {
+        minlen = f->len;
+        reallocptr(&f->data, s->len, sizeof(Hlist));
+        vdiff = s->len - minlen;
+        memcpy(f->data + minlen, s->data + minlen, vdiff * sizeof(Hlist));
+    } else {
+        minlen = s->len;
+    }
+    fhlv = f->data;
+    shlv = s->data;
+    for (i = 0; i < minlen; ++i) {
+        nhlen = shlv[i].len + fhlv[i].len;
+        reallocptr(&fhlv[i].data, nhlen, sizeof(Str));
+        strv = fhlv[i].data + fhlv[i].len;
+        memcpy(strv, shlv[i].data, shlv[i].len * sizeof(Str));
+        fhlv[i].len = nhlen;
+    }
+    if (f->len == minlen) {
+        f->len = s->len;
+    }
+    for (i = 0; i < minlen; ++i) {
+        freemem(shlv[i].data, shlv[i].len * sizeof(Str));
+    }
+    freemem(s->data, s->len * sizeof(Hlist));
+    freemem(s, sizeof(Vlist));
+    return f;
+}
+
+static struct Hlist *
+addhliststr(struct Hlist *f, struct Str *s) {
+    struct Str *str;
+
+    if (f->len == 0) {
+        f->data = s;
+        f->len = 1;
+        return f;
+    }
+    str = &f->data[f->len - 1];
+    ropestr(str, s, POS_END);
+    return f;
+}
+
+static struct Vlist *
+addvliststr(struct Vlist *f, struct Str *s) {
+    struct RowOp op = { .vl = f, .str = s };
+    struct Hlist *hlv;
+
+    if (f->len == 0) {
+        hlv = f->data = emptyhlist();
+        hlv->len = 1;
+        hlv->data = s;
+        return f;
+    }
+    flatstr(s);
+    parrows(f->len, addvliststrrows, &op);
+    freestr(s);
+    freemem(s, sizeof(Str));
+    return f;
+}
+
+static void
+addvliststrrows(void *arg, size_t beg, size_t end) {
+    struct RowOp *op = arg;
+    struct Hlist *hlv = op->vl->data;
+    size_t hlen;
+    size_t i;
+
+    for (i = beg; i < end; ++i) {
+        if ((hlen = hlv[i].len) == 0) {
+            hlv[i].len = 1;
+            hlv[i].data = copystr(op->str);
+            continue;
+        }
+        appendstr(&hlv[i].data[hlen - 1], op->str);
+    }
+}
+
+static struct Str *
+concatstr(struct Str *f, struct Str *s) {
+    return addstrstr(f, s);
+}
+
+static struct Hlist *
+concathlist(struct Hlist *f, struct Hlist *s) {
+    return addhlisthlist(f, s);
+}
+
+static struct Vlist *
+concatvlist(struct Vlist *f, struct Vlist *s) {
+    size_t len = f->len + s->len;
+
+    reallocptr(&f->data, len, sizeof(Hlist));
+    memcpy(f->data + f->len, s->data, s->len * sizeof(Hlist));
+    f->len = len;
+    freemem(s->data, s->len * sizeof(Hlist));
+    freemem(s, sizeof(Vlist));
+    return f;
+}
+
+static void
+execbinaryop(struct Var *f, struct Var *s, char **opp) {
+    char *op = *opp;
+
+    assert(isbinaryop(op));
+
+    if (op == litts[SYM_PLUS]) {
+        addval(f, s);
+        return;
+    } else if (op == litts[SYM_SUB]) {
+        subval(f, s);
+        return;
+    } else if (op == litts[SYM_MOD] || op == litts[SYM_DIV]) {
+        filtval(f, s, op);
+        return;
+    } else if (op == litts[SYM_MUL]) {
+        metaval(f, s, opp + 1);
+        return;
+    }
+    sigerrx("unimplemented, %s", op);
+}
+
+static void
+addval(struct Var *f, struct Var *s) {
+    switch (f->type) {
+    case TYPE_STR:
+        switch (s->type) {
+        case TYPE_STR:
+            f->type = TYPE_STR;
+            f->val.str = addstrstr(f->val.str, s->val.str);
+            return;
+        case TYPE_HLIST:
+            f->type = TYPE_HLIST;
+            f->val.hlist = addstrhlist(f->val.str, s->val.hlist);
+            return;
+        case TYPE_VLIST:
+            f->type = TYPE_VLIST;
+            f->val.vlist = addstrvlist(f->val.str, s->val.vlist);
+            return;
+        }
+    case TYPE_HLIST:
+        switch (s->type) {
+        case TYPE_STR:
+            f->type = TYPE_HLIST;
+            f->val.hlist = addhliststr(f->val.hlist, s->val.str);
+            return;
+        case TYPE_HLIST:
+            f->type = TYPE_HLIST;
+            f->val.hlist = addhlisthlist(f->val.hlist, s->val.hlist);
+            return;
+        case TYPE_VLIST:
+            f->type = TYPE_VLIST;
+            f->val.vlist = addhlistvlist(f->val.hlist, s->val.vlist);
+            return;
+        }
+    case TYPE_VLIST:
+        switch (s->type) {
+        case TYPE_STR:
+            f->type = TYPE_VLIST;
+            f->val.vlist = addvliststr(f->val.vlist, s->val.str);
+            return;
+        case TYPE_HLIST:
+            f->type = TYPE_VLIST;
+            f->val.vlist = addvlisthlist(f->val.vlist, s->val.hlist);
+            return;
+        case TYPE_VLIST:
+            f->type = TYPE_VLIST;
+            f->val.vlist = addvlistvlist(f->val.vlist, s->val.vlist);
+            return;
+        }
+    }
+}
+
+static int
+matchstrstr(struct Str *f, struct Str *s, enum POS pos, enum FIL fil) {
+    if (s->len == 0) {
+        return fil;
+    }
+    if (f->len < s->len) {
+        return !fil;
+    }
+    flatstr(f);
+    flatstr(s);
+    if (pos == POS_BEG) {
+        return memcmp(f->data, s->data, s->len - 1) == 0 ? fil : !fil;
+    }
+    return memcmp(f->data + f->len - s->len, s->data, s->len - 1) == 0 ? fil
+                                                                       : !fil;
+}
+
+static uint64_t
+keystr(struct Str *str, size_t k, enum POS pos) {
+    unsigned char win[sizeof(uint64_t)] = { 0 };
+    size_t n = str->len - 1;
+    uint64_t key;
+    char *data;
+
+    if (str->len <= k) {
+        return 0;
+    }
+    data = flatstr(str);
+    if (n >= sizeof(win)) {
+        n = sizeof(win);
+    }
+    if (pos == POS_BEG) {
+        memcpy(win, data, n);
+    } else {
+        memcpy(win + sizeof(win) - n, data + str->len - 1 - n, n);
+    }
+    memcpy(&key, win, sizeof(key));
+    return key;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("avx2"))) static uint64_t
+matchkeysavx2(uint64_t *keys, size_t n, uint64_t needle, uint64_t mask) {
+    __m256i vneedle = _mm256_set1_epi64x(needle);
+    __m256i vmask = _mm256_set1_epi64x(mask);
+    __m256i v;
+    uint64_t bits = 0;
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        v = _mm256_loadu_si256((__m256i *)(keys + i));
+        v = _mm256_cmpeq_epi64(_mm256_and_si256(v, vmask), vneedle);
+        bits |= (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(v)) << i;
+    }
+    for (; i < n; ++i) {
+        bits |= (uint64_t)((keys[i] & mask) == needle) << i;
+    }
+    return bits;
+}
+#endif
+
+static uint64_t
+matchkeys(uint64_t *keys, size_t n, uint64_t needle, uint64_t mask) {
+    uint64_t bits = 0;
+    size_t i;
+
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        return matchkeysavx2(keys, n, needle, mask);
+    }
+#endif
+    for (i = 0; i < n; ++i) {
+        bits |= (uint64_t)((keys[i] & mask) == needle) << i;
+    }
+    return bits;
+}
+
+static struct Hlist *
+filthlist(struct Hlist *f, struct Str *s, enum POS pos, enum FIL fil) {
+    unsigned char win[sizeof(uint64_t)] = { 0 };
+    uint64_t keys[FILT_BATCH];
+    struct Str *strv = f->data;
+    size_t len = f->len;
+    size_t k = s->len - 1;
+    size_t batch;
+    size_t i;
+    size_t j;
+    uint64_t needle;
+    uint64_t mask;
+    uint64_t bits;
+
+    if (f->len == 0) {
+        return f;
+    }
+    if (s->len < 2 || k > sizeof(uint64_t)) {
+        for (i = 0; i < f->len; ++i) {
+            if (matchstrstr(f->data + i, s, pos, fil)) {
+                memcpy(strv++, f->data + i, sizeof(Str));
+            } else {
+                freestr(f->data + i);
+                --len;
+            }
+        }
+        reallocptr(&f->data, len, sizeof(Str));
+        f->len = len;
+        return f;
+    }
+    memset(pos == POS_BEG ? win : win + sizeof(win) - k, 0xff, k);
+    memcpy(&mask, win, sizeof(mask));
+    needle = keystr(s, 0, pos);
+    for (i = 0; i < f->len; i += batch) {
+        batch = f->len - i < FILT_BATCH ? f->len - i : FILT_BATCH;
+        for (j = 0; j < batch; ++j) {
+            keys[j] = keystr(f->data + i + j, k, pos);
+        }
+        bits = matchkeys(keys, batch, needle, mask);
+        if (fil == FIL_DISCARD) {
+            bits = ~bits;
+        }
+        for (j = 0; j < batch; ++j) {
+            if ((bits >> j) & 1) {
+                memcpy(strv++, f->data + i + j, sizeof(Str));
+            } else {
+                freestr(f->data + i + j);
+                --len;
+            }
+        }
+    }
+    reallocptr(&f->data, len, sizeof(Str));
+    f->len = len;
+    return f;
+}
+
+static struct Hlist *
+subhliststr(struct Hlist *f, struct Str *s, enum POS pos) {
+    struct Str *strv = f->data;
+    size_t len;
+    size_t i;
+
+    if (f->len == 0 || s->len == 0) {
+        return f;
+    }
+    for (i = 0; i < f->len; ++i) {
+        if (matchstrstr(f->data + i, s, pos, FIL_KEEP)) {
+            unsharestr(strv + i);
+            len = strv[i].len - s->len + 1;
+            if (pos == POS_END) {
+                strv[i].data[len - 1] = '\0';
+            } else {
+                memmove(strv[i].data, strv[i].data + s->len - 1, len);
+                strv[i].data[len - 1] = '\0';
+            }
+            reallocptr(&strv[i].data, len, 1);
+            strv[i].len = len;
+        }
+    }
+    return f;
+}
+
+static struct Vlist *
+subvliststr(struct Vlist *f, struct Str *s, enum POS pos) {
+    struct RowOp op = { .vl = f, .str = s, .pos = pos };
+
+    if (f->len == 0 || s->len == 0) {
+        return f;
+    }
+    flatstr(s);
+    parrows(f->len, subvliststrrows, &op);
+    return f;
+}
+
+static void
+subvliststrrows(void *arg, size_t beg, size_t end) {
+    struct RowOp *op = arg;
+    size_t i;
+
+    for (i = beg; i < end; ++i) {
+        subhliststr(op->vl->data + i, op->str, op->pos);
+    }
+}
+
+static void
+subval(struct Var *f, struct Var *s) {
+    enum POS pos;
+    struct Str *strdel;
+
+    switch (f->type) {
+    case TYPE_STR:
+        switch (s->type) {
+        case TYPE_STR:
+            sigerrx("unimplemented: %d", __LINE__);
+        case TYPE_HLIST:
+            pos = POS_BEG;
+            strdel = f->val.str;
+            f->type = TYPE_HLIST;
+            f->val.hlist = subhliststr(s->val.hlist, f->val.str, pos);
+            break;
+        case TYPE_VLIST:
+            pos = POS_BEG;
+            strdel = f->val.str;
+            f->type = TYPE_VLIST;
+            f->val.vlist = subvliststr(s->val.vlist, f->val.str, pos);
+            break;
+        }
+        freestr(strdel);
+        freemem(strdel, sizeof(Str));
+        break;
+    case TYPE_HLIST:
+        switch (s->type) {
+        case TYPE_STR:
+            pos = POS_END;
+            f->type = TYPE_HLIST;
+            f->val.hlist = subhliststr(f->val.hlist, s->val.str, pos);
+            freeval(s);
+            return;
+        case TYPE_HLIST:
+            filtvalset(f, s->val.hlist, FIL_DISCARD);
+            freeval(s);
+            return;
+        case TYPE_VLIST:
+            sigerrx("unimplemented: %d", __LINE__);
+        }
+    case TYPE_VLIST:
+        switch (s->type) {
+        case TYPE_STR:
+            pos = POS_END;
+            f->type = TYPE_VLIST;
+            f->val.vlist = subvliststr(f->val.vlist, s->val.str, pos);
+            freeval(s);
+            return;
+        case TYPE_HLIST:
+            filtvalset(f, s->val.hlist, FIL_DISCARD);
+            freeval(s);
+            return;
+        case TYPE_VLIST:
+            sigerrx("unimplemented: %d", __LINE__);
+        }
+    }
+}
+
+static struct Vlist *
+filtvlist(struct Vlist *f, struct Str *s, enum POS pos, enum FIL fil) {
+    struct RowOp op = { .vl = f, .str = s, .pos = pos, .fil = fil };
+    struct Hlist *hlv = f->data;
+    size_t len = f->len;
+    size_t i;
+
+    if (f->len == 0) {
+        return f;
+    }
+    flatstr(s);
+    parrows(f->len, filtvlistrows, &op);
+    for (i = 0; i < f->len; ++i) {
+        if (f->data[i].len != 0) {
+            memcpy(hlv++, f->data + i, sizeof(Hlist));
+        } else {
+            --len;
+        }
+    }
+    reallocptr(&f->data, len, sizeof(Hlist));
+    f->len = len;
+    return f;
+}
+
+static void
+filtvlistrows(void *arg, size_t beg, size_t end) {
+    struct RowOp *op = arg;
+    size_t i;
+
+    for (i = beg; i < end; ++i) {
+        filthlist(op->vl->data + i, op->str, op->pos, op->fil);
+    }
+}
+
+static void
+filtval(struct Var *f, struct Var *s, char *op) {
+    enum FIL fil = (op == litts[SYM_MOD]) ? FIL_DISCARD : FIL_KEEP;
+    enum POS pos;
+    struct Str *strdel;
+
+    switch (f->type) {
+    case TYPE_STR:
+        switch (s->type) {
+        case TYPE_STR:
+            sigerrx("unimplemented: %d", __LINE__);
+        case TYPE_HLIST:
+            pos = POS_BEG;
+            strdel = f->val.str;
+            f->type = TYPE_HLIST;
+            f->val.hlist = filthlist(s->val.hlist, f->val.str, pos, fil);
+            break;
+        case TYPE_VLIST:
+            strdel = f->val.str;
+            pos = POS_BEG;
+            f->type = TYPE_VLIST;
+            f->val.vlist = filtvlist(s->val.vlist, f->val.str, pos, fil);
+            break;
+        }
+        freestr(strdel);
+        freemem(strdel, sizeof(Str));
+        break;
+    case TYPE_HLIST:
+        switch (s->type) {
+        case TYPE_STR:
+            pos = POS_END;
+            f->type = TYPE_HLIST;
+            f->val.hlist = filthlist(f->val.hlist, s->val.str, pos, fil);
+            freeval(s);
+            return;
+        case TYPE_HLIST:
+            filtvalset(f, s->val.hlist, fil);
+            freeval(s);
+            return;
+        case TYPE_VLIST:
+            sigerrx("unimplemented: %d", __LINE__);
+        }
+        break;
+    case TYPE_VLIST:
+        switch (s->type) {
+        case TYPE_STR:
+            pos = POS_END;
+            f->type = TYPE_VLIST;
+            f->val.vlist = filtvlist(f->val.vlist, s->val.str, pos, fil);
+            freeval(s);
+            return;
+        case TYPE_HLIST:
+            filtvalset(f, s->val.hlist, fil);
+            freeval(s);
+            return;
+        case TYPE_VLIST:
+            sigerrx("unimplemented: %d", __LINE__);
+        }
+    }
+}
+
+static void
+outval(struct Var *res) {
+    struct Hlist *hlv;
+    size_t i;
+    size_t j;
+
+    switch (res->type) {
+    case TYPE_STR:
+        res->val.str->hash = HASH_OUT;
+        break;
+    case TYPE_HLIST:
+        for (i = 0; i < res->val.hlist->len; ++i) {
+            res->val.hlist->data[i].hash = HASH_OUT;
+        }
+        break;
+    case TYPE_VLIST:
+        hlv = res->val.vlist->data;
+        for (j = 0; j < res->val.vlist->len; ++j) {
+            for (i = 0; i < hlv[j].len; ++i) {
+                hlv[j].data[i].hash = HASH_OUT;
+            }
+        }
+    }
+}
+
+static size_t
+hashstr(struct Str *str) {
+    size_t hash = 0xcbf29ce484222325;
+    char *data = flatstr(str);
+    size_t i;
+
+    for (i = 0; i + 1 < str->len; ++i) {
+        hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+static void
+setfromhlist(struct Set *set, struct Hlist *hl) {
+    size_t mask;
+    size_t i;
+    size_t j;
+
+    set->alloc = 16;
+    while (set->alloc < hl->len * 2) {
+        set->alloc *= 2;
+    }
+    if ((set->data = calloc(set->alloc, sizeof(Str *))) == NULL) {
+        err(1, "alloc");
+    }
+    mask = set->alloc - 1;
+    for (i = 0; i < hl->len; ++i) {
+        if (insetstr(set, hl->data + i)) {
+            continue;
+        }
+        j = hashstr(hl->data + i) & mask;
+        while (set->data[j]) {
+            j = (j + 1) & mask;
+        }
+        set->data[j] = hl->data + i;
+    }
+}
+
+static int
+insetstr(struct Set *set, struct Str *str) {
+    size_t mask = set->alloc - 1;
+    size_t j = hashstr(str) & mask;
+    struct Str *curr;
+
+    while ((curr = set->data[j]) != NULL) {
+        if (curr->len == str->len &&
+            memcmp(flatstr(curr), str->data, str->len) == 0) {
+            return 1;
+        }
+        j = (j + 1) & mask;
+    }
+    return 0;
+}
+
+static void
+freeset(struct Set *set) {
+    free(set->data);
+}
+
+static struct Hlist *
+filthlistset(struct Hlist *f, struct Set *set, enum FIL fil) {
+    struct Str *strv = f->data;
+    size_t len = f->len;
+    size_t i;
+
+    if (f->len == 0) {
+        return f;
+    }
+    for (i = 0; i < f->len; ++i) {
+        if (insetstr(set, f->data + i) == (int)fil) {
+            memcpy(strv++, f->data + i, sizeof(Str));
+        } else {
+            freestr(f->data + i);
+            --len;
+        }
+    }
+    reallocptr(&f->data, len, sizeof(Str));
+    f->len = len;
+    return f;
+}
+
+static struct Vlist *
+filtvlistset(struct Vlist *f, struct Set *set, enum FIL fil) {
+    struct Hlist *hlv = f->data;
+    size_t len = f->len;
+    size_t i;
+
+    if (f->len == 0) {
+        return f;
+    }
+    for (i = 0; i < f->len; ++i) {
+        filthlistset(f->data + i, set, fil);
+        if (f->data[i].len != 0) {
+            memcpy(hlv++, f->data + i, sizeof(Hlist));
+        } else {
+            --len;
+        }
+    }
+    reallocptr(&f->data, len, sizeof(Hlist));
+    f->len = len;
+    return f;
+}
+
+static void
+filtvalset(struct Var *f, struct Hlist *s, enum FIL fil) {
+    struct Set set;
+
+    setfromhlist(&set, s);
+    if (f->type == TYPE_HLIST) {
+        f->val.hlist = filthlistset(f->val.hlist, &set, fil);
+    } else {
+        f->val.vlist = filtvlistset(f->val.vlist, &set, fil);
+    }
+    freeset(&set);
+}
+
+static struct Hlist *
+atstr(struct Str *dname, char **cmd, enum STAT stat) {
+    struct Hlist *files = emptyhlist();
+
+    if (dname->len < 2) {
+        sigerrn(cmd - chrbeg(&tokarr), "empty directory name");
+    }
+    if (listdir(files, flatstr(dname), stat) == -1) {
+        sigerrno(cmd - chrbeg(&tokarr), dname->data);
+    }
+    freestr(dname);
+    freemem(dname, sizeof(Str));
+
+    return files;
+}
+
+static int
+listdir(struct Hlist *files, char *dname, enum STAT stat) {
+#ifndef SAKE_LIB
+    int64_t t0 = tracenow();
+    struct Listing key;
+    int fd;
+
+    if (askcache('L', dname, NULL, &fd) && maplisting(files, fd, NULL)) {
+        /* the cache daemon has it */
+    } else if (cachedir == NULL || !statlisting(dname, &key)) {
+        if (readdirents(files, dname) == -1) {
+            return -1;
+        }
+    } else if (!loadlisting(files, &key)) {
+        if (readdirents(files, dname) == -1) {
+            return -1;
+        }
+        storelisting(files, &key);
+    }
+#else
+    if (readdirents(files, dname) == -1) {
+        return -1;
+    }
+#endif
+    if (stat == STAT_FETCH && statlist(files, dname) == -1) {
+        return -1;
+    }
+#ifndef SAKE_LIB
+    watchpath(dname, NULL, stat == STAT_FETCH ? WATCH_META : WATCH_DIR);
+    tracespan("list", dname, t0, tracetid());
+#endif
+    return 0;
+}
+
+static int
+statlist(struct Hlist *files, char *dname) {
+    struct RowOp op = { .hl = files };
+
+    if ((op.fd = open(dname, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        return -1;
+    }
+    parrows(files->len, statrows, &op);
+    close(op.fd);
+    return 0;
+}
+
+static void
+statrows(void *arg, size_t beg, size_t end) {
+    struct RowOp *op = arg;
+    struct Str *strv = op->hl->data;
+    struct statx stx;
+    size_t i;
+
+    for (i = beg; i < end; ++i) {
+        if (statx(op->fd, flatstr(strv + i), AT_SYMLINK_NOFOLLOW,
+                  STATX_TYPE | STATX_SIZE | STATX_MTIME, &stx) == -1) {
+            continue;
+        }
+        strv[i].dtype = IFTODT(stx.stx_mode);
+        strv[i].fsize = stx.stx_size;
+        strv[i].fmtime =
+            stx.stx_mtime.tv_sec * 1000000000 + stx.stx_mtime.tv_nsec;
+    }
+}
+
+static int
+readdirents(struct Hlist *files, char *dname) {
+    struct Share *names = alloc(sizeof(Share) + DENTS_BUF);
+    char *buf = alloc(DENTS_BUF);
+    struct Str *strv = NULL;
+    struct Dirent64 *dent;
+    size_t namealloc = DENTS_BUF;
+    size_t size = 0;
+    size_t len = 0;
+    size_t strvalloc = 0;
+    size_t nlen;
+    long nread;
+    long off;
+    size_t i;
+    int fd;
+
+    files->len = 0;
+    files->data = NULL;
+    if ((fd = open(dname, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        free(names);
+        free(buf);
+        return -1;
+    }
+    while ((nread = syscall(SYS_getdents64, fd, buf, DENTS_BUF)) > 0) {
+        for (off = 0; off < nread; off += dent->d_reclen) {
+            dent = (struct Dirent64 *)(buf + off);
+            if (dent->d_name[0] == '.' &&
+                (dent->d_name[1] == '\0' ||
+                 (dent->d_name[1] == '.' && dent->d_name[2] == '\0'))) {
+                continue;
+            }
+            nlen = strlen(dent->d_name) + 1;
+            if (size + nlen > namealloc) {
+                namealloc = namealloc * 2 + nlen;
+                reallocptr(&names, sizeof(Share) + namealloc, 1);
+            }
+            memcpy(names->data + size, dent->d_name, nlen);
+            size += nlen;
+            if (len == strvalloc) {
+                strvalloc = strvalloc * 2 + 64;
+                reallocptr(&strv, strvalloc, sizeof(Str));
+            }
+            initstr(strv + len, NULL, nlen);
+            strv[len].hash = 1;
+            strv[len].dtype = dent->d_type;
+            ++len;
+        }
+    }
+    close(fd);
+    free(buf);
+    if (nread == -1) {
+        free(names);
+        free(strv);
+        return -1;
+    }
+    if (len == 0) {
+        free(names);
+    } else {
+        reallocptr(&names, sizeof(Share) + size, 1);
+        names->refs = len;
+        names->size = size;
+        names->map = 0;
+    }
+    reallocptr(&strv, len, sizeof(Str));
+    for (i = 0, size = 0; i < len; ++i) {
+        strv[i].data = names->data + size;
+        strv[i].share = names;
+        size += strv[i].len;
+    }
+    sortstrv(strv, len, 0);
+    files->len = len;
+    files->data = strv;
+    return 0;
+}
+
+#ifndef SAKE_LIB
+static int
+statlisting(char *dname, struct Listing *key) {
+    struct statx stx;
+
+    if (statx(AT_FDCWD, dname, 0, STATX_INO | STATX_MTIME | STATX_CTIME,
+              &stx) == -1) {
+        return 0;
+    }
+    key->magic = LISTING_MAGIC;
+    key->dev = (uint64_t)stx.stx_dev_major << 32 | stx.stx_dev_minor;
+    key->ino = stx.stx_ino;
+    key->mtime = stx.stx_mtime.tv_sec * 1000000000 + stx.stx_mtime.tv_nsec;
+    key->ctime = stx.stx_ctime.tv_sec * 1000000000 + stx.stx_ctime.tv_nsec;
+    return 1;
+}
+
+static char *
+listingpath(struct Listing *key) {
+    size_t len = strlen(cachedir) + 64;
+    char *path = alloc(len);
+
+    snprintf(path, len, "%s/l%llx-%llx", cachedir,
+             (unsigned long long)key->dev, (unsigned long long)key->ino);
+    return path;
+}
+
+static int
+loadlisting(struct Hlist *files, struct Listing *key) {
+    char *path = listingpath(key);
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd == -1) {
+        return 0;
+    }
+    return maplisting(files, fd, key);
+}
+
+static int
+maplisting(struct Hlist *files, int fd, struct Listing *key) {
+    struct Listing *hdr;
+    struct Share *share;
+    struct stat st;
+    uint64_t *entv;
+    char *names;
+    size_t size = 0;
+    size_t len;
+    size_t i;
+
+    if (fstat(fd, &st) == -1 ||
+        (size_t)st.st_size < sizeof(Share) + sizeof(Listing)) {
+        close(fd);
+        return 0;
+    }
+    share = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (share == MAP_FAILED) {
+        return 0;
+    }
+    hdr = (struct Listing *)share->data;
+    if (hdr->magic != LISTING_MAGIC ||
+        (key && (hdr->dev != key->dev || hdr->ino != key->ino ||
+                 hdr->mtime != key->mtime || hdr->ctime != key->ctime)) ||
+        hdr->len > (size_t)st.st_size / sizeof(uint64_t) ||
+        hdr->size > (size_t)st.st_size ||
+        sizeof(Share) + sizeof(Listing) + hdr->len * sizeof(uint64_t) +
+                hdr->size !=
+            (size_t)st.st_size) {
+        munmap(share, st.st_size);
+        return 0;
+    }
+    entv = (uint64_t *)(hdr + 1);
+    names = (char *)(entv + hdr->len);
+    /* the file may come from a daemon or a disk we do not trust */
+    for (i = 0; i < hdr->len; ++i) {
+        len = entv[i] >> 8;
+        if (len == 0 || len > hdr->size - size ||
+            names[size + len - 1] != '\0') {
+            munmap(share, st.st_size);
+            return 0;
+        }
+        size += len;
+    }
+    if (size != hdr->size) {
+        munmap(share, st.st_size);
+        return 0;
+    }
+    files->len = hdr->len;
+    files->data = alloc(hdr->len * sizeof(Str));
+    for (i = 0; i < hdr->len; ++i) {
+        initstr(files->data + i, names, entv[i] >> 8);
+        files->data[i].hash = 1;
+        files->data[i].dtype = entv[i] & 0xff;
+        files->data[i].share = share;
+        names += files->data[i].len;
+    }
+    share->refs = hdr->len;
+    share->map = st.st_size;
+    if (hdr->len == 0) {
+        munmap(share, st.st_size);
+    }
+    return 1;
+}
+
+static void
+storelisting(struct Hlist *files, struct Listing *key) {
+    struct timespec now;
+    char *path;
+    char *tmp;
+    FILE *f;
+    int fd;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (key->mtime >= (now.tv_sec - 1) * 1000000000 + now.tv_nsec ||
+        key->ctime >= (now.tv_sec - 1) * 1000000000 + now.tv_nsec) {
+        return;
+    }
+    path = listingpath(key);
+    tmp = alloc(strlen(path) + 8);
+    sprintf(tmp, "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) == -1 || (f = fdopen(fd, "w")) == NULL) {
+        warn("%s", tmp);
+        free(path);
+        free(tmp);
+        return;
+    }
+    writelisting(f, files, key);
+    if (fclose(f) == EOF || rename(tmp, path) == -1) {
+        warn("%s", path);
+        unlink(tmp);
+    }
+    free(path);
+    free(tmp);
+}
+
+static void
+writelisting(FILE *f, struct Hlist *files, struct Listing *key) {
+    struct Share share = { 0 };
+    uint64_t *entv;
+    size_t i;
+
+    key->len = files->len;
+    key->size = 0;
+    entv = alloc(files->len * sizeof(uint64_t));
+    for (i = 0; i < files->len; ++i) {
+        entv[i] = (uint64_t)files->data[i].len << 8 | files->data[i].dtype;
+        key->size += files->data[i].len;
+    }
+    fwrite(&share, sizeof(Share), 1, f);
+    fwrite(key, sizeof(Listing), 1, f);
+    fwrite(entv, sizeof(uint64_t), files->len, f);
+    for (i = 0; i < files->len; ++i) {
+        fwrite(flatstr(files->data + i), 1, files->data[i].len, f);
+    }
+    free(entv);
+}
+#endif
+
+static struct Vlist *
+atlist(struct Hlist *dirs, char **cmd, enum STAT stat) {
+    struct Vlist *res = emptyvlist();
+    struct RowOp op = { .vl = res, .hl = dirs, .stat = stat };
+    struct Hlist *files;
+    struct Str *pat;
+    size_t i;
+
+    flathlist(dirs);
+    for (i = 0; i < dirs->len; ++i) {
+        if (dirs->data[i].len < 2) {
+            sigerrn(cmd - chrbeg(&tokarr), "empty directory name");
+        }
+    }
+    res->len = dirs->len;
+    res->data = alloc(res->len * sizeof(Hlist));
+    if ((op.errs = calloc(dirs->len + 1, sizeof(int))) == NULL) {
+        err(1, "alloc");
+    }
+    parsplit(dirs->len, atlistrows, &op);
+    for (i = 0; i < dirs->len; ++i) {
+        if (op.errs[i]) {
+            errno = op.errs[i];
+            free(op.errs);
+            sigerrno(cmd - chrbeg(&tokarr), dirs->data[i].data);
+        }
+    }
+    free(op.errs);
+    for (i = 0; i < dirs->len; ++i) {
+        if (strstr(dirs->data[i].data, "**")) {
+            pat = copystr(dirs->data + i);
+            files = globstr(pat, strstr(pat->data, "**"), cmd, stat);
+            memcpy(res->data + i, files, sizeof(Hlist));
+            freemem(files, sizeof(Hlist));
+        }
+    }
+    freehlist(dirs);
+    freemem(dirs, sizeof(Hlist));
+    return res;
+}
+
+static void
+atlistrows(void *arg, size_t beg, size_t end) {
+    struct RowOp *op = arg;
+    size_t i;
+
+    for (i = beg; i < end; ++i) {
+        if (strstr(op->hl->data[i].data, "**")) {
+            continue;
+        }
+        if (listdir(op->vl->data + i, op->hl->data[i].data, op->stat)) {
+            op->errs[i] = errno;
+        }
+    }
+}
+
+static void
+sortstrv(struct Str *strv, size_t n, size_t depth) {
+    struct Str tmp;
+    size_t lt;
+    size_t gt;
+    size_t i;
+    size_t j;
+    int pivot;
+    int ch;
+
+    while (n > SORT_INSERT) {
+        memcpy(&tmp, strv, sizeof(Str));
+        memcpy(strv, strv + n / 2, sizeof(Str));
+        memcpy(strv + n / 2, &tmp, sizeof(Str));
+        pivot = (unsigned char)strv[0].data[depth];
+        lt = 0;
+        gt = n;
+        i = 1;
+        while (i < gt) {
+            ch = (unsigned char)strv[i].data[depth];
+            if (ch < pivot) {
+                memcpy(&tmp, strv + lt, sizeof(Str));
+                memcpy(strv + lt++, strv + i, sizeof(Str));
+                memcpy(strv + i++, &tmp, sizeof(Str));
+            } else if (ch > pivot) {
+                memcpy(&tmp, strv + --gt, sizeof(Str));
+                memcpy(strv + gt, strv + i, sizeof(Str));
+                memcpy(strv + i, &tmp, sizeof(Str));
+            } else {
+                ++i;
+            }
+        }
+        sortstrv(strv, lt, depth);
+        if (pivot) {
+            sortstrv(strv + lt, gt - lt, depth + 1);
+        }
+        strv += gt;
+        n -= gt;
+    }
+    for (i = 1; i < n; ++i) {
+        memcpy(&tmp, strv + i, sizeof(Str));
+        for (j = i; j > 0; --j) {
+            if (strcmp(strv[j - 1].data + depth, tmp.data + depth) <= 0) {
+                break;
+            }
+            memcpy(strv + j, strv + j - 1, sizeof(Str));
+        }
+        memcpy(strv + j, &tmp, sizeof(Str));
+    }
+}
+
+static struct Hlist *
+globstr(struct Str *pat, char *glob, char **cmd, enum STAT stat) {
+    struct Walk walk = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .wake = PTHREAD_COND_INITIALIZER,
+        .watchmask = stat == STAT_FETCH ? WATCH_META : WATCH_DIR,
+    };
+    struct Hlist *files = emptyhlist();
+    struct Walkdir *root = alloc(sizeof(Walkdir));
+    size_t nslots = initpool();
+    size_t len = 0;
+    size_t i;
+    char *suffix = glob + 2;
+    char *rootpath;
+    char errpath[PATH_MAX];
+#ifndef SAKE_LIB
+    int64_t t0 = tracenow();
+#endif
+
+    /* after the ** and its slash come nothing, *suffix or a whole name */
+    if (*suffix == '/') {
+        ++suffix;
+        walk.exact = *suffix && *suffix != '*';
+        suffix += !walk.exact;
+    }
+    if ((glob > pat->data && glob[-1] != '/') ||
+        (suffix == glob + 2 && *suffix) || strchr(suffix, '*') ||
+        strchr(suffix, '/')) {
+        sigerrn(cmd - chrbeg(&tokarr), "unsupported recursive pattern");
+    }
+    initstr(&walk.suffix, suffix, strlen(suffix) + 1);
+
+    while (glob > pat->data && glob[-1] == '/') {
+        --glob;
+    }
+    root->len = glob - pat->data;
+    root->path = alloc(root->len + 3);
+    if (root->len == 0) {
+        root->path[root->len++] = '.';
+    } else {
+        memcpy(root->path, pat->data, root->len);
+    }
+    root->path[root->len++] = '/';
+    root->path[root->len] = '\0';
+    root->parent = NULL;
+    root->refs = 1;
+    walk.rootlen = root->len;
+    rootpath = memown(root->path, root->len + 1);
+
+    initarr(&walk.queue, 64);
+    pusharr(&walk.queue, root);
+    if ((walk.found = calloc(nslots, sizeof(Hlist))) == NULL ||
+        (walk.foundalloc = calloc(nslots, sizeof(size_t))) == NULL) {
+        err(1, "alloc");
+    }
+    parsplit(nslots, walkdirs, &walk);
+
+    for (i = 0; i < nslots; ++i) {
+        len += walk.found[i].len;
+    }
+    files->len = len;
+    files->data = alloc(len * sizeof(Str));
+    for (i = 0, len = 0; i < nslots; ++i) {
+        memcpy(files->data + len, walk.found[i].data,
+               walk.found[i].len * sizeof(Str));
+        len += walk.found[i].len;
+        free(walk.found[i].data);
+    }
+    sortstrv(files->data, files->len, 0);
+    if (walk.err == 0 && stat == STAT_FETCH &&
+        statlist(files, rootpath) == -1) {
+        walk.err = errno;
+        walk.errpath = rootpath;
+        rootpath = NULL;
+    }
+    free(rootpath);
+    free(walk.found);
+    free(walk.foundalloc);
+    free(walk.queue.data);
+    if (walk.err) {
+        freehlist(files);
+        freemem(files, sizeof(Hlist));
+        freestr(pat);
+        freemem(pat, sizeof(Str));
+        snprintf(errpath, sizeof(errpath), "%s", walk.errpath);
+        free(walk.errpath);
+        errno = walk.err;
+        sigerrno(cmd - chrbeg(&tokarr), errpath);
+    }
+#ifndef SAKE_LIB
+    tracespan("list", pat->data, t0, tracetid());
+#endif
+    freestr(pat);
+    freemem(pat, sizeof(Str));
+
+    return files;
+}
+
+static void
+walkdirs(void *arg, size_t slot, size_t end) {
+    struct Walk *walk = arg;
+    struct Walkdir *dir;
+
+    (void)end;
+    for (;;) {
+        pthread_mutex_lock(&walk->lock);
+        while (walk->queue.len == 0 && walk->active) {
+            pthread_cond_wait(&walk->wake, &walk->lock);
+        }
+        if (walk->queue.len == 0) {
+            pthread_cond_broadcast(&walk->wake);
+            pthread_mutex_unlock(&walk->lock);
+            return;
+        }
+        dir = walk->queue.data[--walk->queue.len];
+        ++walk->active;
+        pthread_mutex_unlock(&walk->lock);
+
+        walkdir(walk, dir, slot);
+
+        pthread_mutex_lock(&walk->lock);
+        if (--walk->active == 0 && walk->queue.len == 0) {
+            pthread_cond_broadcast(&walk->wake);
+        }
+        pthread_mutex_unlock(&walk->lock);
+    }
+}
+
+static void
+walkdir(struct Walk *walk, struct Walkdir *dir, size_t slot) {
+    struct Hlist *found = walk->found + slot;
+    struct Walkdir *parent = dir->parent;
+    char *buf = alloc(DENTS_BUF);
+    struct Dirent64 *dent;
+    struct stat st;
+    struct Str *strv;
+    size_t nlen;
+    long nread;
+    long off;
+    int isdir;
+
+    dir->fd = openat(parent ? parent->fd : AT_FDCWD,
+                     parent ? dir->path + parent->len : dir->path,
+                     O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (parent) {
+        dropwalkdir(parent);
+    }
+    if (dir->fd == -1) {
+        if (parent == NULL) {
+            failwalk(walk, dir->path);
+            dropwalkdir(dir);
+            free(buf);
+            return;
+        }
+        warn("open %s", dir->path);
+        dropwalkdir(dir);
+        free(buf);
+        return;
+    }
+#ifndef SAKE_LIB
+    watchpath(dir->path, NULL, walk->watchmask);
+#endif
+    while ((nread = syscall(SYS_getdents64, dir->fd, buf, DENTS_BUF)) > 0) {
+        for (off = 0; off < nread; off += dent->d_reclen) {
+            dent = (struct Dirent64 *)(buf + off);
+            if (dent->d_name[0] == '.' &&
+                (dent->d_name[1] == '\0' ||
+                 (dent->d_name[1] == '.' && dent->d_name[2] == '\0'))) {
+                continue;
+            }
+            isdir = dent->d_type == DT_DIR;
+            if (dent->d_type == DT_UNKNOWN &&
+                fstatat(dir->fd, dent->d_name, &st, AT_SYMLINK_NOFOLLOW) !=
+                    -1) {
+                isdir = S_ISDIR(st.st_mode);
+            }
+            if (isdir) {
+                pushwalkdir(walk, dir, dent->d_name);
+                continue;
+            }
+            nlen = strlen(dent->d_name) + 1;
+            if ((walk->exact && walk->suffix.len != nlen) ||
+                walk->suffix.len > nlen ||
+                memcmp(dent->d_name + nlen - walk->suffix.len,
+                       walk->suffix.data, walk->suffix.len) != 0) {
+                continue;
+            }
+            if (found->len == walk->foundalloc[slot]) {
+                walk->foundalloc[slot] = walk->foundalloc[slot] * 2 + 64;
+                reallocptr(&found->data, walk->foundalloc[slot], sizeof(Str));
+            }
+            strv = found->data + found->len++;
+            initstr(strv, NULL, dir->len - walk->rootlen + nlen);
+            strv->hash = 1;
+            strv->dtype = dent->d_type;
+            strv->data = alloc(strv->len);
+            memcpy(strv->data, dir->path + walk->rootlen,
+                   dir->len - walk->rootlen);
+            memcpy(strv->data + dir->len - walk->rootlen, dent->d_name, nlen);
+        }
+    }
+    if (nread == -1) {
+        failwalk(walk, dir->path);
+    }
+    free(buf);
+    dropwalkdir(dir);
+}
+
+static void
+failwalk(struct Walk *walk, char *path) {
+    int e = errno;
+
+    pthread_mutex_lock(&walk->lock);
+    if (walk->err == 0) {
+        walk->err = e;
+        if ((walk->errpath = strdup(path)) == NULL) {
+            err(1, "alloc");
+        }
+    }
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static void
+pushwalkdir(struct Walk *walk, struct Walkdir *parent, char *name) {
+    struct Walkdir *dir = alloc(sizeof(Walkdir));
+    size_t nlen = strlen(name);
+
+    dir->parent = parent;
+    dir->refs = 1;
+    dir->len = parent->len + nlen + 1;
+    dir->path = alloc(dir->len + 1);
+    memcpy(dir->path, parent->path, parent->len);
+    memcpy(dir->path + parent->len, name, nlen);
+    dir->path[dir->len - 1] = '/';
+    dir->path[dir->len] = '\0';
+    __atomic_add_fetch(&parent->refs, 1, __ATOMIC_ACQ_REL);
+
+    pthread_mutex_lock(&walk->lock);
+    pusharr(&walk->queue, dir);
+    pthread_cond_signal(&walk->wake);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static void
+dropwalkdir(struct Walkdir *dir) {
+    if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (dir->fd != -1) {
+            close(dir->fd);
+        }
+        free(dir->path);
+        free(dir);
+    }
+}
+
+static void
+atval(struct Var *v, char **cmd, enum STAT stat) {
+    char *glob;
+
+    switch (v->type) {
+    case TYPE_STR:
+        v->type = TYPE_HLIST;
+        if ((glob = strstr(flatstr(v->val.str), "**")) != NULL) {
+            v->val.hlist = globstr(v->val.str, glob, cmd, stat);
+        } else {
+            v->val.hlist = atstr(v->val.str, cmd, stat);
+        }
+        break;
+    case TYPE_HLIST:
+        v->type = TYPE_VLIST;
+        v->val.vlist = atlist(v->val.hlist, cmd, stat);
+        break;
+    case TYPE_VLIST:
+        convert(v, TYPE_HLIST);
+        v->type = TYPE_VLIST;
+        v->val.vlist = atlist(v->val.hlist, cmd, stat);
+        break;
+    }
+}
+
+static void
+capval(struct Var *v, char **cmd, enum SPLIT split) {
+    jmp_buf *prev = stmtjmp;
+    struct Share **sharev;
+    uint64_t *keyv;
+    struct Hlist *volatile hlv = NULL;
+    struct Hlist *hl;
+    struct Vlist *vl;
+    volatile size_t nrows = 1;
+    volatile int owned = 1;
+    size_t len;
+    size_t i;
+    int *outv;
+    int fd;
+    jmp_buf jmp;
+
+    switch (v->type) {
+    case TYPE_STR:
+        convert(v, TYPE_HLIST);
+        /* FALLTHROUGH */
+    case TYPE_HLIST:
+        hlv = v->val.hlist;
+        break;
+    case TYPE_VLIST:
+        hlv = v->val.vlist->data;
+        nrows = v->val.vlist->len;
+        break;
+    }
+    outv = alloc(nrows * sizeof(int));
+    sharev = alloc(nrows * sizeof(Share *));
+    keyv = alloc(nrows * sizeof(uint64_t));
+    for (i = 0; i < nrows; ++i) {
+        outv[i] = -1;
+        sharev[i] = NULL;
+    }
+    /* a failing command or call drops the captures before moving on */
+    stmtjmp = &jmp;
+    if (setjmp(jmp)) {
+        for (i = 0; i < nrows; ++i) {
+            if (outv[i] != -1) {
+                close(outv[i]);
+            }
+            if (sharev[i] && sharev[i]->refs == 0) {
+                munmap(sharev[i], sharev[i]->map);
+            }
+        }
+        free(sharev);
+        free(outv);
+        free(keyv);
+        if (owned) {
+            freeval(v);
+        }
+        if ((stmtjmp = prev) != NULL) {
+            longjmp(*prev, 1);
+        }
+        exit(EXIT_FAILURE);
+    }
+    waitjobs(JOB_ALL);
+    for (i = 0; i < nrows; ++i) {
+        if (hlv[i].len == 0) {
+            continue;
+        }
+#ifndef SAKE_LIB
+        if (memo) {
+            keyv[i] = memokey(hlv + i);
+            if ((sharev[i] = loadmemo(keyv[i])) != NULL) {
+                freehlist(hlv + i);
+                hlv[i].len = 0;
+                hlv[i].data = NULL;
+                continue;
+            }
+        }
+#endif
+        if ((outv[i] = memfd_create("sake", MFD_CLOEXEC)) == -1) {
+            sigerr("memfd_create");
+        }
+        /* children write past the header mapcapture fills in, so the
+         * output is mapped as a share without being read or copied */
+        if (lseek(outv[i], sizeof(Share), SEEK_SET) == -1) {
+            sigerr("lseek");
+        }
+        if ((fd = fcntl(outv[i], F_DUPFD_CLOEXEC, 0)) == -1) {
+            sigerr("dup");
+        }
+        /* the job closes its own copy */
+        queuejob(hlv + i, cmd, "captured command failed", fd);
+    }
+    waitjobs(JOB_ALL);
+    freeval(v);
+    owned = 0;
+    for (i = 0; i < nrows; ++i) {
+        if (outv[i] != -1) {
+            sharev[i] = mapcapture(outv[i]);
+            outv[i] = -1;
+#ifndef SAKE_LIB
+            if (memo) {
+                storememo(keyv[i], sharev[i]);
+            }
+#endif
+        }
+    }
+    for (i = 0, len = 0; i < nrows; ++i) {
+        if (sharev[i]) {
+            len += splitshare(sharev[i], NULL, split);
+        }
+    }
+    if (split == SPLIT_WORDS) {
+        hl = alloc(sizeof(Hlist));
+        hl->len = len;
+        hl->data = alloc(len * sizeof(Str));
+        for (i = 0, len = 0; i < nrows; ++i) {
+            if (sharev[i]) {
+                len += splitshare(sharev[i], hl->data + len, split);
+            }
+        }
+        v->type = TYPE_HLIST;
+        v->val.hlist = hl;
+    } else {
+        vl = alloc(sizeof(Vlist));
+        vl->len = len;
+        vl->data = alloc(len * sizeof(Hlist));
+        for (i = 0, len = 0; i < nrows; ++i) {
+            if (sharev[i]) {
+                len += splitshare(sharev[i], vl->data + len, split);
+            }
+        }
+        v->type = TYPE_VLIST;
+        v->val.vlist = vl;
+    }
+    stmtjmp = prev;
+    for (i = 0; i < nrows; ++i) {
+        if (sharev[i] && sharev[i]->refs == 0) {
+            munmap(sharev[i], sharev[i]->map);
+        }
+    }
+    free(sharev);
+    free(outv);
+    free(keyv);
+}
+
+static struct Share *
+mapcapture(int fd) {
+    struct Share *share;
+    struct stat st;
+    size_t size = 0;
+
+    if (fstat(fd, &st) == -1) {
+        sigerr("fstat");
+    }
+    if ((size_t)st.st_size > sizeof(Share)) {
+        size = st.st_size - sizeof(Share);
+    }
+    /* one zero byte past the output terminates the last word */
+    if (ftruncate(fd, sizeof(Share) + size + 1) == -1) {
+        sigerr("ftruncate");
+    }
+    share = mmap(NULL, sizeof(Share) + size + 1, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+    if (share == MAP_FAILED) {
+        sigerr("mmap");
+    }
+    close(fd);
+    share->refs = 0;
+    share->size = size;
+    share->map = sizeof(Share) + size + 1;
+    return share;
+}
+
+static size_t
+splitwords(char *beg, char *end, struct Str *strv, struct Share *share) {
+    size_t n = 0;
+    char *word;
+
+    for (;;) {
+        while (beg < end && isspace((unsigned char)*beg)) {
+            ++beg;
+        }
+        if (beg == end) {
+            return n;
+        }
+        word = beg;
+        while (beg < end && !isspace((unsigned char)*beg)) {
+            ++beg;
+        }
+        if (strv) {
+            *beg = '\0';
+            initstr(strv + n, word, beg - word + 1);
+            strv[n].share = share;
+            ++share->refs;
+        }
+        ++n;
+        if (beg < end) {
+            ++beg;
+        }
+    }
+}
+
+static size_t
+splitshare(struct Share *share, void *res, enum SPLIT split) {
+    struct Hlist *rowv = res;
+    char *beg = share->data;
+    char *end = share->data + share->size;
+    char *eol;
+    size_t nrows = 0;
+    size_t n;
+
+    if (split == SPLIT_WORDS) {
+        return splitwords(beg, end, res, share);
+    }
+    for (; beg < end; beg = eol + 1) {
+        if ((eol = memchr(beg, '\n', end - beg)) == NULL) {
+            eol = end;
+        }
+        if ((n = splitwords(beg, eol, NULL, NULL)) == 0) {
+            continue;
+        }
+        if (rowv) {
+            rowv[nrows].len = n;
+            rowv[nrows].data = alloc(n * sizeof(Str));
+            splitwords(beg, eol, rowv[nrows].data, share);
+        }
+        ++nrows;
+    }
+    return nrows;
+}
+
+#ifndef SAKE_LIB
+static uint64_t
+hashbytes(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t word;
+    size_t n = len;
+
+    /* murmur3 style, every input bit reaches every output bit */
+    for (; n >= sizeof(word); n -= sizeof(word), p += sizeof(word)) {
+        memcpy(&word, p, sizeof(word));
+        hash ^= mixword(word);
+        hash = ((hash << 27) | (hash >> 37)) * 5 + 0x52dce729;
+    }
+    for (word = 0; n; --n) {
+        word = (word << 8) | p[n - 1];
+    }
+    hash ^= mixword(word) ^ len;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccd;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static uint64_t
+mixword(uint64_t word) {
+    word *= 0x87c37b91114253d5;
+    word = (word << 31) | (word >> 33);
+    return word * 0x4cf5ad432745937f;
+}
+
+static uint64_t
+hashfile(char *path) {
+    uint64_t hash = 0xcbf29ce484222325;
+    struct stat st;
+    void *data;
+    int fd;
+
+    if (askcache('H', path, &hash, NULL)) {
+        return hash;
+    }
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        return 0;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return 0;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return hash;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return 0;
+    }
+    hash = hashbytes(hash, data, st.st_size);
+    munmap(data, st.st_size);
+    return hash;
+}
+
+static uint64_t
+memokey(struct Hlist *row) {
+    char *cwd = curdir();
+    uint64_t key = 0xcbf29ce484222325;
+    uint64_t sum;
+    char *data;
+    char *val;
+    size_t i;
+
+    key = hashbytes(key, cwd, strlen(cwd) + 1);
+    for (i = 0; i < row->len; ++i) {
+        data = flatstr(row->data + i);
+        key = hashbytes(key, data, row->data[i].len);
+        if (row->data[i].hash == 1) {
+            sum = hashfile(data);
+            key = hashbytes(key, &sum, sizeof(sum));
+        }
+    }
+    for (i = 0; i < memoenv.len; ++i) {
+        data = memoenv.data[i];
+        key = hashbytes(key, data, strlen(data) + 1);
+        if ((val = getenv(data)) != NULL) {
+            key = hashbytes(key, val, strlen(val) + 1);
+        }
+    }
+    return key;
+}
+
+static char *
+curdir(void) {
+    static char *cwd;
+
+    if (cwd == NULL && (cwd = getcwd(NULL, 0)) == NULL) {
+        err(1, "getcwd");
+    }
+    return cwd;
+}
+
+static void
+servecache(void) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct pollfd *pfdv = alloc(sizeof(struct pollfd) * 2);
+    size_t npfd = 2;
+    size_t i;
+    int fd;
+
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/sock", cachedir) >=
+        (int)sizeof(addr.sun_path)) {
+        errx(1, "cachedir path too long for a socket: %s", cachedir);
+    }
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1) {
+        err(1, "socket");
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        errx(1, "already serving %s", cachedir);
+    }
+    unlink(addr.sun_path);
+    if (listenlocal(fd, &addr) == -1) {
+        err(1, "%s", addr.sun_path);
+    }
+    pfdv[0].fd = fd;
+    pfdv[0].events = POLLIN;
+    if ((pfdv[1].fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) == -1) {
+        err(1, "inotify_init1");
+    }
+    pfdv[1].events = POLLIN;
+    initarr(&entries, 64);
+    for (;;) {
+        if (poll(pfdv, npfd, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            err(1, "poll");
+        }
+        if (pfdv[1].revents) {
+            readentries(pfdv[1].fd);
+        }
+        for (i = 2; i < npfd; ++i) {
+            if (pfdv[i].revents && answercache(pfdv[i].fd, pfdv[1].fd) == -1) {
+                close(pfdv[i].fd);
+                pfdv[i--] = pfdv[--npfd];
+            }
+        }
+        if (pfdv[0].revents &&
+            (fd = accept4(pfdv[0].fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+            /* our reads and hashes are not for other users */
+            if (!ownpeer(fd)) {
+                close(fd);
+                continue;
+            }
+            reallocptr(&pfdv, npfd + 1, sizeof(struct pollfd));
+            pfdv[npfd].fd = fd;
+            pfdv[npfd++].events = POLLIN;
+        }
+    }
+}
+
+static int
+answercache(int fd, int ino) {
+    char buf[PATH_MAX + 2];
+    char cbuf[CMSG_SPACE(sizeof(int))] = { 0 };
+    struct iovec iov;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    struct cmsghdr *cmsg;
+    struct Entry *ent = NULL;
+    struct Entry key = { .path = buf + 1 };
+    uint64_t sum = 0;
+    size_t pos;
+    ssize_t n;
+
+    if ((n = recv(fd, buf, sizeof(buf) - 1, 0)) <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    key.kind = buf[0];
+    /* changes made before the request are queued by now */
+    readentries(ino);
+    pos = findentry(&key);
+    if (pos < entries.len &&
+        sortentry(entries.data + pos, &(struct Entry *){ &key }) == 0) {
+        ent = entries.data[pos];
+    } else if (key.kind == 'L' || key.kind == 'H') {
+        ent = addentry(key.kind, key.path, ino, pos);
+    }
+    if (ent && ent->kind == 'H') {
+        sum = ent->sum;
+    }
+    iov.iov_base = &sum;
+    /* a single byte has the client do the work itself */
+    iov.iov_len = ent ? sizeof(sum) : 1;
+    if (ent && ent->kind == 'L') {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &ent->fd, sizeof(int));
+    }
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+/* where key is in entries or would go */
+static size_t
+findentry(struct Entry *key) {
+    size_t lo = 0;
+    size_t hi = entries.len;
+    size_t mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (sortentry(entries.data + mid, &key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static struct Entry *
+addentry(char kind, char *path, int ino, size_t pos) {
+    struct Entry *ent = alloc(sizeof(Entry));
+    struct Listing key;
+    struct Hlist files;
+    char *dir;
+    FILE *f;
+    int fd;
+
+    ent->kind = kind;
+    ent->dead = 0;
+    ent->path = NULL;
+    ent->fd = -1;
+    ent->wd = -1;
+    ent->dwd = -1;
+    ent->sum = 0;
+    /* watch before reading, a change in between then drops the entry */
+    if (kind == 'L') {
+        ent->wd = inotify_add_watch(ino, path, IN_MASK_ADD | DIR_EVENTS);
+        if (ent->wd == -1 || !statlisting(path, &key) ||
+            (fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+            freeentry(ent, ino);
+            return NULL;
+        }
+        close(fd);
+        if (readdirents(&files, path) == -1) {
+            freeentry(ent, ino);
+            return NULL;
+        }
+        ent->fd = memfd_create("sake", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (ent->fd == -1 || (fd = dup(ent->fd)) == -1 ||
+            (f = fdopen(fd, "w")) == NULL) {
+            err(1, "memfd_create");
+        }
+        writelisting(f, &files, &key);
+        if (fclose(f) == EOF) {
+            err(1, "memfd");
+        }
+        /* clients map it privately, which older kernels refuse once
+         * F_SEAL_WRITE is set */
+        fcntl(ent->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+        freehlist(&files);
+    } else {
+        dir = strdup(path);
+        ent->wd = inotify_add_watch(ino, path, IN_MASK_ADD | FILE_EVENTS);
+        ent->dwd =
+            inotify_add_watch(ino, dirname(dir), IN_MASK_ADD | DIR_EVENTS);
+        free(dir);
+        if (ent->wd == -1 || ent->dwd == -1) {
+            freeentry(ent, ino);
+            return NULL;
+        }
+        ent->sum = hashfile(path);
+    }
+    ent->path = strdup(path);
+    ent->base = strrchr(ent->path, '/');
+    ent->base = ent->base ? ent->base + 1 : ent->path;
+    reallocarr(&entries, 1);
+    memmove(entries.data + pos + 1, entries.data + pos,
+            (entries.len++ - pos) * sizeof(void *));
+    entries.data[pos] = ent;
+    indexwd(ent->wd, ent);
+    indexwd(ent->dwd, ent);
+    return ent;
+}
+
+/* ent is out of entries by now, the watches it shares stay */
+static void
+freeentry(struct Entry *ent, int ino) {
+    unindexwd(ent->wd, ent);
+    unindexwd(ent->dwd, ent);
+    unwatch(ino, ent->wd);
+    unwatch(ino, ent->dwd);
+    if (ent->fd != -1) {
+        close(ent->fd);
+    }
+    free(ent->path);
+    free(ent);
+}
+
+static void
+indexwd(int wd, struct Entry *ent) {
+    size_t n = nwdents;
+
+    if (wd == -1) {
+        return;
+    }
+    if ((size_t)wd >= nwdents) {
+        nwdents = wd * 2 + 64;
+        reallocptr(&wdents, nwdents, sizeof(Arr));
+        memset(wdents + n, 0, (nwdents - n) * sizeof(Arr));
+    }
+    pusharr(wdents + wd, ent);
+}
+
+static void
+unindexwd(int wd, struct Entry *ent) {
+    struct Arr *arr;
+    size_t i;
+
+    if (wd == -1 || (size_t)wd >= nwdents) {
+        return;
+    }
+    arr = wdents + wd;
+    for (i = 0; i < arr->len; ++i) {
+        if (arr->data[i] == ent) {
+            arr->data[i] = arr->data[--arr->len];
+            return;
+        }
+    }
+}
+
+static void
+unwatch(int ino, int wd) {
+    if (wd == -1 || ((size_t)wd < nwdents && wdents[wd].len)) {
+        return;
+    }
+    inotify_rm_watch(ino, wd);
+}
+
+static int
+sortentry(const void *f, const void *s) {
+    const struct Entry *fe = *(struct Entry **)f;
+    const struct Entry *se = *(struct Entry **)s;
+
+    if (fe->kind != se->kind) {
+        return fe->kind - se->kind;
+    }
+    return strcmp(fe->path, se->path);
+}
+
+static void
+readentries(int ino) {
+    char buf[0x10000]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    struct Arr dropped = { 0, 0, NULL };
+    struct Arr *arr;
+    struct Entry *ent;
+    ssize_t n;
+    ssize_t off;
+    size_t i;
+    size_t j;
+
+    /* an event only visits the entries watching its wd */
+    while ((n = read(ino, buf, sizeof(buf))) > 0) {
+        for (off = 0; off < n; off += sizeof(*ev) + ev->len) {
+            ev = (struct inotify_event *)(buf + off);
+            if (ev->mask & IN_Q_OVERFLOW) {
+                arr = &entries;
+            } else if (ev->wd >= 0 && (size_t)ev->wd < nwdents) {
+                arr = wdents + ev->wd;
+            } else {
+                continue;
+            }
+            for (i = 0; i < arr->len; ++i) {
+                ent = arr->data[i];
+                if (!ent->dead &&
+                    (arr == &entries || ent->wd == ev->wd ||
+                     (ev->len && strcmp(ent->base, ev->name) == 0))) {
+                    ent->dead = 1;
+                    pusharr(&dropped, ent);
+                }
+            }
+        }
+    }
+    if (dropped.len == 0) {
+        return;
+    }
+    for (i = 0, j = 0; i < entries.len; ++i) {
+        if (!((struct Entry *)entries.data[i])->dead) {
+            entries.data[j++] = entries.data[i];
+        }
+    }
+    entries.len = j;
+    for (i = 0; i < dropped.len; ++i) {
+        freeentry(dropped.data[i], ino);
+    }
+    free(dropped.data);
+}
+
+static void
+opencache(void) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/sock", cachedir) >=
+        (int)sizeof(addr.sun_path)) {
+        return;
+    }
+    if ((cachefd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1) {
+        return;
+    }
+    if (connect(cachefd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(cachefd);
+        cachefd = -1;
+        return;
+    }
+    curdir();
+}
+
+static int
+askcache(char kind, char *path, uint64_t *sum, int *fd) {
+    char buf[PATH_MAX + 2];
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    uint64_t res;
+    struct iovec iov = { .iov_base = &res, .iov_len = sizeof(res) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cbuf,
+        .msg_controllen = sizeof(cbuf),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t n = -1;
+    int len;
+
+    if (cachefd < 0) {
+        return 0;
+    }
+    buf[0] = kind;
+    if (path[0] == '/') {
+        len = snprintf(buf + 1, sizeof(buf) - 1, "%s", path);
+    } else {
+        len = snprintf(buf + 1, sizeof(buf) - 1, "%s/%s", curdir(), path);
+    }
+    if (len >= (int)sizeof(buf) - 1) {
+        return 0;
+    }
+    pthread_mutex_lock(&cachelock);
+    if (cachefd >= 0 && send(cachefd, buf, len + 1, MSG_NOSIGNAL) != -1) {
+        n = recvmsg(cachefd, &msg, MSG_CMSG_CLOEXEC);
+    }
+    if (n == 1) {
+        /* no answer, yet the daemon is fine */
+        pthread_mutex_unlock(&cachelock);
+        return 0;
+    }
+    if (n != sizeof(res)) {
+        /* the daemon went away, do the work here from now on */
+        if (cachefd >= 0) {
+            close(cachefd);
+            cachefd = -1;
+        }
+        pthread_mutex_unlock(&cachelock);
+        return 0;
+    }
+    pthread_mutex_unlock(&cachelock);
+    if (sum) {
+        *sum = res;
+        return 1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        return 0;
+    }
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    return 1;
+}
+
+static struct Share *
+loadmemo(uint64_t key) {
+    char *path = cachepath('m', key);
+    struct Share *share;
+    struct stat st;
+    uint64_t sum;
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        free(path);
+        return NULL;
+    }
+    n = read(fd, &sum, sizeof(sum));
+    close(fd);
+    free(path);
+    /* outputs are stored once under their own hash, keys only name one */
+    path = cachepath('o', sum);
+    fd = n == sizeof(sum) ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    free(path);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size <= sizeof(Share)) {
+        close(fd);
+        return NULL;
+    }
+    share = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (share == MAP_FAILED) {
+        return NULL;
+    }
+    share->refs = 0;
+    share->size = st.st_size - sizeof(Share) - 1;
+    share->map = st.st_size;
+    return share;
+}
+
+static void
+storememo(uint64_t key, struct Share *share) {
+    uint64_t sum = hashbytes(0xcbf29ce484222325, share->data, share->size);
+    char *path = cachepath('o', sum);
+
+    if (access(path, F_OK) == -1) {
+        writeatomic(path, share, share->map);
+    }
+    free(path);
+    path = cachepath('m', key);
+    writeatomic(path, &sum, sizeof(sum));
+    free(path);
+}
+
+static void
+writeatomic(char *path, const void *data, size_t len) {
+    char *tmp = alloc(strlen(path) + 8);
+    ssize_t n = -1;
+    int fd;
+
+    sprintf(tmp, "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) == -1) {
+        warn("%s", tmp);
+        free(tmp);
+        return;
+    }
+    n = write(fd, data, len);
+    if (close(fd) == -1 || n != (ssize_t)len || rename(tmp, path) == -1) {
+        warn("%s", path);
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+static char *
+cachepath(char kind, uint64_t key) {
+    char *path = alloc(strlen(cachedir) + 20);
+
+    sprintf(path, "%s/%c%016llx", cachedir, kind, (unsigned long long)key);
+    return path;
+}
+
+static size_t
+countoutputs(struct Hlist *row) {
+    size_t n = 0;
+    size_t i;
+
+    for (i = 0; i < row->len; ++i) {
+        n += row->data[i].hash == HASH_OUT;
+    }
+    return n;
+}
+
+static int
+restoreoutputs(uint64_t key, struct Hlist *row) {
+    char *path = cachepath('a', key);
+    uint64_t *ent = NULL;
+    struct stat st;
+    size_t nouts = countoutputs(row);
+    size_t size = (2 + 2 * nouts) * sizeof(uint64_t);
+    size_t i;
+    size_t j;
+    int in;
+
+    /* a{key} holds the magic, the output count, then the content hash
+     * and mode of every > argument in order, stored as f{hash} */
+    if ((in = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        free(path);
+        return 0;
+    }
+    free(path);
+    ent = alloc(size);
+    if (fstat(in, &st) == -1 || (size_t)st.st_size != size ||
+        read(in, ent, size) != (ssize_t)size || ent[0] != OUTPUTS_MAGIC ||
+        ent[1] != nouts) {
+        close(in);
+        free(ent);
+        return 0;
+    }
+    close(in);
+    for (i = 0, j = 2; i < row->len; ++i) {
+        if (row->data[i].hash != HASH_OUT) {
+            continue;
+        }
+        path = cachepath('f', ent[j]);
+        in = open(path, O_RDONLY | O_CLOEXEC);
+        free(path);
+        if (in == -1) {
+            break;
+        }
+        if (fstat(in, &st) == -1 ||
+            copyto(in, st.st_size, flatstr(row->data + i), ent[j + 1]) ==
+                -1) {
+            close(in);
+            break;
+        }
+        close(in);
+        j += 2;
+    }
+    free(ent);
+    return j == size / sizeof(uint64_t);
+}
+
+static void
+storeoutputs(uint64_t key, struct Hlist *row) {
+    size_t nouts = countoutputs(row);
+    uint64_t *ent = alloc((2 + 2 * nouts) * sizeof(uint64_t));
+    struct stat st;
+    size_t i;
+    size_t j;
+    char *path;
+    int in;
+
+    ent[0] = OUTPUTS_MAGIC;
+    ent[1] = nouts;
+    for (i = 0, j = 2; i < row->len; ++i) {
+        if (row->data[i].hash != HASH_OUT) {
+            continue;
+        }
+        if ((in = open(flatstr(row->data + i), O_RDONLY | O_CLOEXEC)) == -1) {
+            free(ent);
+            return;
+        }
+        if (fstat(in, &st) == -1 || !S_ISREG(st.st_mode)) {
+            close(in);
+            free(ent);
+            return;
+        }
+        ent[j] = hashfile(row->data[i].data);
+        ent[j + 1] = st.st_mode & 07777;
+        path = cachepath('f', ent[j]);
+        if (access(path, F_OK) == -1 &&
+            copyto(in, st.st_size, path, 0444) == -1) {
+            warn("%s", path);
+            close(in);
+            free(path);
+            free(ent);
+            return;
+        }
+        close(in);
+        free(path);
+        j += 2;
+    }
+    path = cachepath('a', key);
+    writeatomic(path, ent, j * sizeof(uint64_t));
+    free(path);
+    free(ent);
+}
+
+static int
+copyto(int in, size_t len, char *path, mode_t mode) {
+    char *tmp = alloc(strlen(path) + 8);
+    int res;
+    int out;
+
+    sprintf(tmp, "%s.XXXXXX", path);
+    if ((out = mkstemp(tmp)) == -1) {
+        free(tmp);
+        return -1;
+    }
+    res = fchmod(out, mode) == -1 ? -1 : copyfile(in, out, len);
+    if (close(out) == -1 || res == -1 || rename(tmp, path) == -1) {
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+static int
+copyfile(int in, int out, size_t len) {
+    ssize_t n;
+
+    if (ioctl(out, FICLONE, in) == 0) {
+        return 0;
+    }
+    while (len) {
+        if ((n = copy_file_range(in, NULL, out, NULL, len, 0)) <= 0) {
+            break;
+        }
+        len -= n;
+    }
+    /* older kernels refuse to copy across filesystems */
+    while (len) {
+        if ((n = sendfile(out, in, NULL, len)) <= 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+#endif
+
+static void
+parsemeta(struct Str *s, struct MetaFilt *filt, char **cmd) {
+    char *data = flatstr(s);
+    struct statx stx;
+    char *end;
+
+    switch (data[0]) {
+    case '>':
+    case '<':
+        filt->kind = data[0] == '>' ? META_LARGER : META_SMALLER;
+        filt->val = strtoll(data + 1, &end, 10);
+        if (end == data + 1) {
+            sigerrn(cmd - chrbeg(&tokarr), "malformed size filter");
+        }
+        switch (*end) {
+        case 'G':
+            filt->val *= 1024;
+            /* FALLTHROUGH */
+        case 'M':
+            filt->val *= 1024;
+            /* FALLTHROUGH */
+        case 'k':
+            filt->val *= 1024;
+            ++end;
+        }
+        if (*end) {
+            sigerrn(cmd - chrbeg(&tokarr), "malformed size filter");
+        }
+        break;
+    case ':':
+        filt->kind = META_DTYPE;
+        if (strcmp(data, ":f") == 0) {
+            filt->val = DT_REG;
+        } else if (strcmp(data, ":d") == 0) {
+            filt->val = DT_DIR;
+        } else if (strcmp(data, ":l") == 0) {
+            filt->val = DT_LNK;
+        } else {
+            sigerrn(cmd - chrbeg(&tokarr), "malformed type filter");
+        }
+        break;
+    default:
+        filt->kind = META_NEWER;
+        if (statx(AT_FDCWD, data, 0, STATX_MTIME, &stx) == -1) {
+            filt->val = INT64_MIN;
+        } else {
+            filt->val =
+                stx.stx_mtime.tv_sec * 1000000000 + stx.stx_mtime.tv_nsec;
+        }
+    }
+}
+
+static int
+matchmeta(struct Str *str, struct MetaFilt *filt) {
+    struct RowOp op = { .hl = &(struct Hlist){ 1, str }, .fd = AT_FDCWD };
+
+    if (filt->kind == META_DTYPE && str->dtype != DT_UNKNOWN) {
+        return str->dtype == filt->val;
+    }
+    /* a plain word names a path from here */
+    if (str->fmtime == -1) {
+        statrows(&op, 0, 1);
+    }
+    if (str->fmtime == -1) {
+        return 0;
+    }
+    switch (filt->kind) {
+    case META_NEWER:
+        return str->fmtime > filt->val;
+    case META_LARGER:
+        return str->fsize > filt->val;
+    case META_SMALLER:
+        return str->fsize < filt->val;
+    case META_DTYPE:
+        return str->dtype == filt->val;
+    }
+    return 0;
+}
+
+static struct Hlist *
+metahlist(struct Hlist *f, struct MetaFilt *filt) {
+    struct Str *strv = f->data;
+    size_t len = f->len;
+    size_t i;
+
+    if (f->len == 0) {
+        return f;
+    }
+    filt->hl = f;
+    filt->keep = alloc(f->len);
+    parrows(f->len, metarows, filt);
+    for (i = 0; i < f->len; ++i) {
+        if (filt->keep[i]) {
+            memcpy(strv++, f->data + i, sizeof(Str));
+        } else {
+            freestr(f->data + i);
+            --len;
+        }
+    }
+    free(filt->keep);
+    reallocptr(&f->data, len, sizeof(Str));
+    f->len = len;
+    return f;
+}
+
+static void
+metarows(void *arg, size_t beg, size_t end) {
+    struct MetaFilt *filt = arg;
+    size_t i;
+
+    for (i = beg; i < end; ++i) {
+        filt->keep[i] = matchmeta(filt->hl->data + i, filt);
+    }
+}
+
+static void
+metaval(struct Var *f, struct Var *s, char **cmd) {
+    struct MetaFilt filt;
+    struct Hlist *hlv;
+    size_t len;
+    size_t i;
+    size_t j;
+
+    if (f->type == TYPE_STR || s->type != TYPE_STR) {
+        sigerrx("unimplemented: %d", __LINE__);
+    }
+    parsemeta(s->val.str, &filt, cmd);
+    /* names out of @ are relative to a directory the value forgot, only
+     * @@ stored what they need */
+    hlv = f->type == TYPE_HLIST ? f->val.hlist : f->val.vlist->data;
+    len = f->type == TYPE_HLIST ? 1 : f->val.vlist->len;
+    for (i = 0; i < len && filt.kind != META_DTYPE; ++i) {
+        for (j = 0; j < hlv[i].len; ++j) {
+            if (hlv[i].data[j].dtype != DT_UNKNOWN &&
+                hlv[i].data[j].fmtime == -1) {
+                sigerrn(cmd - chrbeg(&tokarr),
+                        "size and time filters need an @@ listing");
+            }
+        }
+    }
+    if (f->type == TYPE_HLIST) {
+        metahlist(f->val.hlist, &filt);
+    } else {
+        hlv = f->val.vlist->data;
+        len = f->val.vlist->len;
+        for (i = 0; i < f->val.vlist->len; ++i) {
+            metahlist(f->val.vlist->data + i, &filt);
+            if (f->val.vlist->data[i].len != 0) {
+                memcpy(hlv++, f->val.vlist->data + i, sizeof(Hlist));
+            } else {
+                --len;
+            }
+        }
+        reallocptr(&f->val.vlist->data, len, sizeof(Hlist));
+        f->val.vlist->len = len;
+    }
+    freeval(s);
+}
+
+static void
+freemem(void *p, size_t size) {
+    ++stats.frees;
+    stats.freebytes += size;
+    if (DEALLOC_QUOTA == 0) {
+        free(p);
+        return;
+    }
+    if (size > DEALLOC_QUOTA) {
+        free(p);
+        return;
+    }
+    if (squalo.store + size > DEALLOC_QUOTA) {
+        flushmem();
+    }
+    pusharr(&squalo.delay, p);
+    squalo.store += size;
+}
+
+static void
+flushmem(void) {
+    size_t i;
+
+    ++stats.flushes;
+    for (i = 0; i < squalo.delay.len; ++i) {
+        free(squalo.delay.data[i]);
+    }
+    squalo.delay.len = 0;
+    squalo.store = 0;
+}
+
+static size_t
+initpool(void) {
+    long ncpu;
+    size_t i;
+
+    if (pool.threads) {
+        return pool.nthreads;
+    }
+    if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+        ncpu = 1;
+    }
+    pool.nthreads = ncpu;
+    pool.threads = alloc(pool.nthreads * sizeof(pthread_t));
+    for (i = 1; i < pool.nthreads; ++i) {
+        if ((errno = pthread_create(pool.threads + i, NULL, poolworker,
+                                    (void *)i))) {
+            err(1, "pthread_create");
+        }
+    }
+    return pool.nthreads;
+}
+
+static void *
+poolworker(void *arg) {
+    size_t id = (size_t)arg;
+    size_t gen = 0;
+    size_t n;
+
+    inpool = 1;
+    addstats();
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.gen == gen) {
+            pthread_cond_wait(&pool.wake, &pool.lock);
         }
-        *beg = *dup;
+        gen = pool.gen;
+        n = pool.n;
+        pthread_mutex_unlock(&pool.lock);
+
+        pool.fn(pool.arg, n * id / pool.nthreads,
+                n * (id + 1) / pool.nthreads);
+        flushmem();
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.busy == 0) {
+            pthread_cond_signal(&pool.idle);
+        }
+        pthread_mutex_unlock(&pool.lock);
     }
-    arr->len = beg - chrbeg(arr);
-    shrinkarr(arr);
+    return NULL;
 }
 
 static void
-mapfromarr(struct Map *map, struct Arr *arr) {
-    initarr(&map->namearr, 0);
-    copymkarr(&map->namearr, arr);
-    sortstrarr(&map->namearr);
-    uniqarr(&map->namearr);
-    if ((map->node = calloc(map->namearr.len, sizeof(Var))) == NULL) {
-        err(1, "alloc");
+parrows(size_t n, void (*fn)(void *, size_t, size_t), void *arg) {
+    if (n < PAR_ROWS) {
+        fn(arg, 0, n);
+        return;
     }
+    parsplit(n, fn, arg);
 }
 
-static void *
-alloc(size_t s) {
-    void *res;
-
-    if ((res = malloc(s)) == NULL) {
-        err(1, "alloc");
+static void
+parsplit(size_t n, void (*fn)(void *, size_t, size_t), void *arg) {
+    /* another context holding the workers runs its rows on its own */
+    if (inpool || pthread_mutex_trylock(&pool.owner)) {
+        fn(arg, 0, n);
+        return;
     }
-    return res;
+    if (initpool() < 2) {
+        pthread_mutex_unlock(&pool.owner);
+        fn(arg, 0, n);
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.n = n;
+    pool.busy = pool.nthreads - 1;
+    ++pool.gen;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    inpool = 1;
+    fn(arg, 0, n / pool.nthreads);
+    inpool = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.busy) {
+        pthread_cond_wait(&pool.idle, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.owner);
 }
 
+#ifndef SAKE_LIB
 static void
-reallocptr(void *p, size_t nmemb, size_t size) {
-    void **ptr = p;
-    size_t nsize = nmemb * size;
+watchpath(char *dname, char *name, uint32_t mask) {
+    struct Watch *w;
+    int wd;
 
-    if (nmemb && size && SIZE_MAX / nmemb < size) {
-        errno = ENOMEM;
-        err(1, "alloc");
+    if (currstmt == NULL) {
+        return;
     }
-    if ((*ptr = realloc(*ptr, nsize)) == NULL && nsize) {
-        err(1, "alloc");
+    if ((wd = inotify_add_watch(watchfd, dname, mask | IN_MASK_ADD)) == -1) {
+        return;
     }
+    w = alloc(sizeof(Watch));
+    w->wd = wd;
+    w->mask = mask;
+    w->name = name ? memown(name, strlen(name) + 1) : NULL;
+    w->stmt = currstmt - stmtv;
+    pthread_mutex_lock(&watchlock);
+    pusharr(&watcharr, w);
+    pthread_mutex_unlock(&watchlock);
 }
 
-static struct Str *
-strfromhlist(struct Hlist *hl) {
-    size_t len = 0;
-    struct Str *str;
-    char *beg;
-    size_t i;
+static void
+watchfile(char *path, uint32_t mask) {
+    char *slash;
+    char *dname;
 
-    for (i = 0; i < hl->len; ++i) {
-        len += hl->data[i].len;
+    if (currstmt == NULL) {
+        return;
     }
-    len = len - hl->len + 1;
-    str = alloc(sizeof(Str));
-    str->len = len;
-    str->hash = 0;
-    beg = str->data = alloc(len);
-    for (i = 0; i < hl->len; ++i) {
-        if (hl->data[i].len) {
-            memcpy(beg, hl->data[i].data, hl->data[i].len - 1);
-            beg += hl->data[i].len - 1;
-        }
+    if ((slash = strrchr(path, '/')) == NULL) {
+        watchpath(".", path, mask);
+        return;
     }
-    *beg = '\0';
-    freehlist(hl);
-    freemem(hl, sizeof(Hlist));
-    return str;
+    dname = memown(path, slash - path + 2);
+    dname[slash == path ? 1 : slash - path] = '\0';
+    watchpath(dname, slash + 1, mask);
+    free(dname);
 }
 
-static struct Str *
-strfromvlist(struct Vlist *vl) {
-    struct Hlist *curr;
-    struct Str *str;
-    char *beg;
+static void
+dropwatches(size_t stmt) {
+    struct Watch **wv = (struct Watch **)watcharr.data;
+    struct Watch *w;
     size_t len = 0;
     size_t i;
     size_t j;
 
-    for (j = 0; j < vl->len; ++j) {
-        curr = vl->data + j;
-        for (i = 0; i < curr->len; ++i) {
-            len += curr->data[i].len;
+    for (i = 0; i < watcharr.len; ++i) {
+        if (wv[i]->stmt != stmt) {
+            w = wv[i];
+            wv[i] = wv[len];
+            wv[len++] = w;
         }
-        len = len - curr->len + 1;
     }
-    str = alloc(sizeof(Str));
-    str->len = len;
-    str->hash = 0;
-    beg = str->data = alloc(len);
-    for (j = 0; j < vl->len; ++j) {
-        curr = vl->data + j;
-        for (i = 0; i < curr->len; ++i) {
-            if (curr->data[i].len) {
-                memcpy(beg, curr->data[i].data, curr->data[i].len - 1);
-                beg += curr->data[i].len - 1;
-            }
+    /* statements and the script share a wd when they watch one inode,
+     * removing it twice only fails */
+    for (i = len; i < watcharr.len; ++i) {
+        for (j = 0; j < len && wv[j]->wd != wv[i]->wd; ++j) {
         }
+        if (j == len) {
+            inotify_rm_watch(watchfd, wv[i]->wd);
+        }
+        free(wv[i]->name);
+        free(wv[i]);
     }
-    *beg = '\0';
-    freevlist(vl);
-    freemem(vl, sizeof(Vlist));
-    return str;
+    watcharr.len = len;
 }
 
-static struct Vlist *
-vlistfromhlist(struct Hlist *hl) {
-    struct Str *strbeg = hl->data;
-    struct Hlist *hlv = alloc(hl->len * sizeof(Hlist));
-    struct Vlist *vl = (struct Vlist *)hl;
+static size_t
+initstmts(char **toks, char **tokend) {
+    struct Arr *names = &aliasmap.namearr;
+    char **curr = toks;
+    size_t nstmt = 0;
     size_t i;
 
-    for (i = 0; i < hl->len; ++i) {
-        hlv[i].len = 1;
-        hlv[i].data = memown(strbeg + i, sizeof(Str));
+    for (curr = toks; curr < tokend; ++curr) {
+        if (*curr == litts[SYM_SEMICOL]) {
+            ++nstmt;
+        }
     }
-    vl->data = hlv;
-    freemem(strbeg, hl->len * sizeof(Str));
-    return vl;
-}
-
-static struct Hlist *
-hlistfromstr(struct Str *s) {
-    struct Hlist *hl = alloc(sizeof(Hlist));
-
-    hl->len = 1;
-    hl->data = s;
-
-    return hl;
-}
-
-static struct Vlist *
-vlistfromstr(struct Str *s) {
-    struct Vlist *vl = alloc(sizeof(Vlist));
-
-    vl->len = 1;
-    vl->data = alloc(sizeof(Hlist));
-    vl->data[0].len = 1;
-    vl->data[0].data = s;
-    return vl;
+    stmtv = alloc(nstmt * sizeof(Stmt));
+    for (curr = toks, i = 0; i < nstmt; ++i, ++curr) {
+        stmtv[i].beg = curr;
+        while (*curr != litts[SYM_SEMICOL]) {
+            ++curr;
+        }
+        stmtv[i].end = curr;
+        stmtv[i].alias = SIZE_MAX;
+        if (curr - stmtv[i].beg > 2 && stmtv[i].beg[1] == litts[SYM_EQ] &&
+            searcharr(stmtv[i].beg, names)) {
+            stmtv[i].alias = searcharr(stmtv[i].beg, names) - chrbeg(names);
+        }
+        initarr(&stmtv[i].reads, 4);
+        stmtv[i].dirty = 1;
+    }
+    return nstmt;
 }
 
-static struct Hlist *
-hlistfromvlist(struct Vlist *vl) {
-    size_t vlen = vl->len;
-    size_t len = 0;
-    struct Hlist *hlv = vl->data;
-    struct Hlist *hl = (struct Hlist *)vl;
-    struct Str *beg;
+static void
+evalwatched(struct Stmt *stmt, size_t nstmt) {
+    unsigned char *changed = calloc(aliasmap.namearr.len + 1, 1);
+    int reassigned = 0;
+    int dirty = 0;
+    volatile int64_t t0;
+    jmp_buf jmp;
     size_t i;
+    size_t j;
 
-    for (i = 0; i < vlen; ++i) {
-        len += hlv[i].len;
+    if (changed == NULL) {
+        err(1, "alloc");
     }
-    hl->len = len;
-    hl->data = alloc(sizeof(Str) * len);
-    beg = hl->data;
-
-    for (i = 0; i < vlen; ++i) {
-        memcpy(beg, hlv[i].data, sizeof(Str) * hlv[i].len);
-        beg += hlv[i].len;
+    for (i = 0; i < nstmt; ++i) {
+        if (stmt[i].alias != SIZE_MAX && changed[stmt[i].alias]++) {
+            reassigned = 1;
+        }
+        dirty |= stmt[i].dirty;
     }
-    for (i = 0; i < vlen; ++i) {
-        freemem(hlv[i].data, hlv[i].len * sizeof(Str));
+    /* earlier statements may have overwritten what a rerun would read */
+    for (i = 0; reassigned && dirty && i < nstmt; ++i) {
+        stmt[i].dirty = 1;
     }
-    freemem(hlv, sizeof(Hlist));
-    return hl;
+    memset(changed, 0, aliasmap.namearr.len + 1);
+    runstart = monons();
+    for (i = 0; i < nstmt; ++i) {
+        for (j = 0; !stmt[i].dirty && j < stmt[i].reads.len; ++j) {
+            stmt[i].dirty = changed[(uintptr_t)stmt[i].reads.data[j]];
+        }
+        if (!stmt[i].dirty) {
+            continue;
+        }
+        stmt[i].dirty = 0;
+        stmt[i].reads.len = 0;
+        dropwatches(i);
+        currstmt = stmt + i;
+        stmtjmp = &jmp;
+        t0 = tracenow();
+        if (setjmp(jmp) == 0) {
+            evalstmnt(stmt[i].beg, stmt[i].end);
+            tracestmt(stmt[i].beg, stmt[i].end, t0);
+            if (stmt[i].alias != SIZE_MAX) {
+                changed[stmt[i].alias] = 1;
+            }
+        }
+        stmtjmp = NULL;
+        currstmt = NULL;
+    }
+    stmtjmp = &jmp;
+    if (setjmp(jmp) == 0) {
+        waitjobs(JOB_ALL);
+    }
+    stmtjmp = NULL;
+    savehistory();
+    reportjobs();
+    if (tracef) {
+        fflush(tracef);
+    }
+    fflush(stdout);
+    free(changed);
 }
 
-static void
-convert(struct Var *from, enum TYPE totype) {
-    if (from->type == totype) {
-        return;
+static int
+readwatch(size_t nstmt, char *script, char **argv) {
+    struct Watch **wv = (struct Watch **)watcharr.data;
+    char buf[0x10000]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    int nevents = 0;
+    ssize_t nread;
+    ssize_t off;
+    size_t i;
+
+    if ((nread = read(watchfd, buf, sizeof(buf))) == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        err(1, "read inotify");
     }
-    switch (from->type) {
-    case TYPE_STR:
-        if (totype == TYPE_HLIST) {
-            from->val.hlist = hlistfromstr(from->val.str);
-        } else if (totype == TYPE_VLIST) {
-            from->val.vlist = vlistfromstr(from->val.str);
-        } else {
-            assert("BUG: unreacheble");
+    for (off = 0; off < nread; off += sizeof(*ev) + ev->len) {
+        ev = (struct inotify_event *)(buf + off);
+        if (ev->mask & IN_Q_OVERFLOW) {
+            for (i = 0; i < nstmt; ++i) {
+                stmtv[i].dirty = 1;
+            }
+            ++nevents;
+            continue;
         }
-        break;
-    case TYPE_HLIST:
-        if (totype == TYPE_STR) {
-            from->val.str = strfromhlist(from->val.hlist);
-        } else if (totype == TYPE_VLIST) {
-            from->val.vlist = vlistfromhlist(from->val.hlist);
-        } else {
-            assert("BUG: unreacheble");
+        if (ev->wd == wv[0]->wd && ev->len && strcmp(ev->name, script) == 0 &&
+            (ev->mask & WATCH_META)) {
+            execv("/proc/self/exe", argv);
+            err(1, "execv");
         }
-        break;
-    case TYPE_VLIST:
-        if (totype == TYPE_STR) {
-            from->val.str = strfromvlist(from->val.vlist);
-        } else if (totype == TYPE_HLIST) {
-            from->val.hlist = hlistfromvlist(from->val.vlist);
-        } else {
-            assert("BUG: unreacheble");
+        for (i = 1; i < watcharr.len; ++i) {
+            if (wv[i]->wd == ev->wd && (wv[i]->mask & ev->mask) &&
+                (wv[i]->name == NULL ||
+                 (ev->len && strcmp(wv[i]->name, ev->name) == 0))) {
+                stmtv[wv[i]->stmt].dirty = 1;
+                ++nevents;
+            }
         }
-        break;
     }
-    from->type = totype;
+    return nevents;
 }
 
 static void
-appendstr(struct Str *f, struct Str *s) {
-    f->hash &= s->hash;
-    if (s->len == 0) {
-        return;
+watchmk(char **argv) {
+    struct pollfd pfd = { .fd = watchfd, .events = POLLIN };
+    size_t nstmt;
+    char *base;
+    int nevents;
+
+    nstmt = initstmts(chrbeg(&tokarr), chrend(&tokarr));
+    initarr(&watcharr, 64);
+    currstmt = stmtv;
+    watchfile((char *)fname, WATCH_META);
+    currstmt = NULL;
+    if (watcharr.len == 0) {
+        err(1, "inotify_add_watch %s", fname);
     }
-    if (f->len == 0) {
-        reallocptr(&f->data, s->len, 1);
-        memcpy(f->data, s->data, s->len);
-        f->len = s->len;
-        return;
+    ((struct Watch *)watcharr.data[0])->stmt = SIZE_MAX;
+    base = ((struct Watch *)watcharr.data[0])->name;
+
+    for (;;) {
+        evalwatched(stmtv, nstmt);
+        nevents = 0;
+        while (nevents == 0) {
+            if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+                err(1, "poll");
+            }
+            nevents = readwatch(nstmt, base, argv);
+        }
+        while (poll(&pfd, 1, WATCH_SETTLE) > 0) {
+            readwatch(nstmt, base, argv);
+        }
     }
-    reallocptr(&f->data, f->len + s->len - 1, 1);
-    memcpy(f->data + f->len - 1, s->data, s->len);
-    f->len += s->len - 1;
 }
 
 static void
-prepend(struct Str *f, struct Str *s) {
-    f->hash &= s->hash;
-    if (s->len == 0) {
-        return;
+servemk(char **argv) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct pollfd pfd = { .events = POLLIN };
+    struct stat st;
+    struct stat now;
+    char fdstr[16];
+    char *env;
+    pid_t pid;
+    int fd;
+
+    if (stat(fname, &st) == -1) {
+        err(1, "stat %s", fname);
     }
-    if (f->len == 0) {
-        reallocptr(&f->data, s->len, 1);
-        memcpy(f->data, s->data, s->len);
-        f->len = s->len;
-        return;
+    if ((env = getenv("SAKE_SERVE")) != NULL) {
+        pfd.fd = atoi(env);
+        unsetenv("SAKE_SERVE");
+        fcntl(pfd.fd, F_SETFD, FD_CLOEXEC);
+    } else {
+        if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", servepath) >=
+            (int)sizeof(addr.sun_path)) {
+            errx(1, "socket path too long: %s", servepath);
+        }
+        if ((pfd.fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) ==
+            -1) {
+            err(1, "socket");
+        }
+        unlink(servepath);
+        if (listenlocal(pfd.fd, &addr) == -1) {
+            err(1, "%s", servepath);
+        }
+    }
+    signal(SIGCHLD, SIG_IGN);
+    fflush(stdout);
+    for (;;) {
+        if (poll(&pfd, 1, -1) == -1) {
+            continue;
+        }
+        if (stat(fname, &now) == -1 || now.st_ino != st.st_ino ||
+            now.st_size != st.st_size ||
+            now.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+            now.st_mtim.tv_nsec != st.st_mtim.tv_nsec) {
+            /* parse again from scratch, clients wait in the backlog */
+            snprintf(fdstr, sizeof(fdstr), "%d", pfd.fd);
+            setenv("SAKE_SERVE", fdstr, 1);
+            fcntl(pfd.fd, F_SETFD, 0);
+            execv("/proc/self/exe", argv);
+            err(1, "execv");
+        }
+        if ((fd = accept4(pfd.fd, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+            continue;
+        }
+        /* a request runs commands as us, only we may make one */
+        if (!ownpeer(fd)) {
+            close(fd);
+            continue;
+        }
+        if ((pid = fork()) == -1) {
+            warn("fork");
+        } else if (pid == 0) {
+            close(pfd.fd);
+            signal(SIGCHLD, SIG_DFL);
+            runrequest(fd);
+        }
+        close(fd);
     }
-    reallocptr(&f->data, f->len - 1 + s->len, 1);
-    memmove(f->data + s->len - 1, f->data, f->len);
-    memcpy(f->data, s->data, s->len - 1);
-    f->len += s->len - 1;
-}
-
-static struct Str *
-addstrstr(struct Str *f, struct Str *s) {
-    appendstr(f, s);
-    freestr(s);
-    freemem(s, sizeof(Str));
-    return f;
 }
 
-static struct Hlist *
-addstrhlist(struct Str *f, struct Hlist *s) {
-    struct Str *str = s->data;
-
-    if (s->len == 0) {
-        s->data = f;
-        s->len = 1;
-        freemem(f, sizeof(Str));
-        return s;
+/* binds addr for the user alone, whatever the umask and directory */
+static int
+listenlocal(int fd, struct sockaddr_un *addr) {
+    mode_t mask = umask(0077);
+    int res;
+
+    res = bind(fd, (struct sockaddr *)addr, sizeof(*addr));
+    umask(mask);
+    if (res == -1 || chmod(addr->sun_path, 0600) == -1) {
+        return -1;
     }
-
-    prepend(str, f);
-    freemem(f->data, f->len);
-    freemem(f, sizeof(Str));
-    return s;
+    return listen(fd, 64);
 }
 
-static struct Vlist *
-addstrvlist(struct Str *f, struct Vlist *s) {
-    struct Str *str;
-    struct Hlist *hlv = s->data;
-    size_t len = s->len;
-    size_t i;
+static int
+ownpeer(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
 
-    if (f->len == 0) {
-        freemem(f, sizeof(Str));
-        return s;
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+           cred.uid == getuid();
+}
+
+static void
+runrequest(int fd) {
+    char *buf = alloc(SERVE_MSG + 1);
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { .iov_base = buf, .iov_len = SERVE_MSG };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cbuf,
+        .msg_controllen = sizeof(cbuf),
+    };
+    struct cmsghdr *cmsg;
+    pthread_t thread;
+    char **argv;
+    int fdv[3];
+    int res = -1;
+    ssize_t n;
+    char *arg;
+    int argc;
+    int i;
+
+    if ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) <= 0 ||
+        (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fdv))) {
+        _exit(1);
     }
-    for (i = 0; i < len; ++i) {
-        str = (hlv + i)->data;
-        str->hash &= f->hash;
-        if (str->len == 0) {
-            reallocptr(&str->data, f->len, 1);
-            memcpy(str->data, f->data, f->len);
-            str->len = f->len;
-            continue;
+    buf[n] = '\0';
+    memcpy(fdv, CMSG_DATA(cmsg), sizeof(fdv));
+    /* only a client in the same directory with the same script */
+    if (strcmp(buf, curdir()) != 0 ||
+        strcmp(buf + strlen(buf) + 1, fname) != 0) {
+        send(fd, &res, sizeof(res), MSG_NOSIGNAL);
+        _exit(1);
+    }
+    for (i = 0; i < 3; ++i) {
+        if (dup2(fdv[i], i) == -1) {
+            _exit(1);
         }
-        reallocptr(&str->data, str->len + f->len - 1, 1);
-        memmove(str->data + f->len - 1, str->data, str->len);
-        memcpy(str->data, f->data, f->len - 1);
-        str->len += f->len - 1;
+        close(fdv[i]);
     }
-    freemem(f->data, f->len);
-    freemem(f, sizeof(Str));
-    return s;
+    res = 0;
+    if (send(fd, &res, sizeof(res), MSG_NOSIGNAL) == -1) {
+        _exit(1);
+    }
+    servefd = fd;
+    on_exit(replyrequest, NULL);
+    /* the jobs get the client's environment and options, not ours */
+    arg = buf + strlen(buf) + 1;
+    arg += strlen(arg) + 1;
+    argc = atoi(arg);
+    argv = alloc((argc + 1) * sizeof(*argv));
+    for (i = 0; i <= argc; ++i) {
+        arg += strlen(arg) + 1;
+        argv[i] = i < argc ? arg : NULL;
+    }
+    clearenv();
+    for (; arg < buf + n; arg += strlen(arg) + 1) {
+        putenv(arg);
+    }
+    /* a client gone, say by ^C, takes the commands it started along */
+    if (setpgid(0, 0) == 0 &&
+        pthread_create(&thread, NULL, watchclient, &servefd) == 0) {
+        pthread_detach(thread);
+    }
+    optind = 0;
+    parseopts(argc, argv);
+    checkopts();
+    if (cachedir) {
+        opencache();
+    }
+    loadhistory();
+    addwarmcmds(argv + optind, argc - optind);
+    runstart = monons();
+    evalmk(chrbeg(&tokarr), chrend(&tokarr));
+    phases[PHASE_EVAL] = monons() - runstart;
+    exit(0);
 }
 
-static struct Hlist *
-addhlisthlist(struct Hlist *f, struct Hlist *s) {
-    size_t len = f->len + s->len;
+static void *
+watchclient(void *arg) {
+    struct pollfd pfd = { .fd = *(int *)arg, .events = POLLIN };
 
-    if (f->len == 0) {
-        freemem(f, sizeof(Hlist));
-        return s;
+    while (poll(&pfd, 1, -1) == -1 && errno == EINTR) {
     }
-    reallocptr(&f->data, len, sizeof(Str));
-    memcpy(f->data + f->len, s->data, s->len * sizeof(Str));
-    f->len = len;
-    freemem(s->data, s->len * sizeof(Str));
-    freemem(s, sizeof(Hlist));
-    return f;
+    kill(0, SIGTERM);
+    return NULL;
 }
 
-static struct Vlist *
-addhlistvlist(struct Hlist *f, struct Vlist *s) {
+static void
+replyrequest(int status, void *arg) {
+    (void)arg;
+    fflush(stdout);
+    fflush(stderr);
+    send(servefd, &status, sizeof(status), MSG_NOSIGNAL);
+}
+
+static void
+addwarmcmds(char **cmds, size_t size) {
+    size_t len = 0;
+    char *text;
+    char *beg;
     size_t i;
-    size_t j;
-    struct Hlist *hlv;
 
-    if (s->len == 0) {
-        s->len = 1;
-        s->data = f;
-        return s;
+    for (i = 0; i < size; ++i) {
+        len += strlen(cmds[i]) + 1;
     }
-    hlv = s->data;
-    for (i = 0; i < s->len; ++i) {
-        reallocptr(&hlv[i].data, hlv[i].len + f->len, sizeof(Str));
-        memmove(hlv[i].data + f->len, hlv[i].data, f->len * sizeof(Str));
-        memcpy(hlv[i].data, f->data, f->len * sizeof(Str));
-        for (j = 0; j < f->len; ++j) {
-            hlv[i].data[j].data = alloc(hlv[i].data[j].len);
-            memcpy(hlv[i].data[j].data, f->data[j].data, hlv[i].data[j].len);
-        }
-        hlv[i].len += f->len;
+    if (len == 0) {
+        return;
     }
-    freehlist(f);
-    freemem(f, sizeof(Hlist));
-    return s;
+    text = alloc(len + 1);
+    for (beg = text, i = 0; i < size; ++i) {
+        beg = stpcpy(beg, cmds[i]);
+        *beg++ = ';';
+    }
+    *beg = '\0';
+    appendmk(text);
 }
+#endif
 
-static struct Vlist *
-addvlisthlist(struct Vlist *s, struct Hlist *f) {
-    struct Hlist *hlv;
-    struct Str *strp;
+static void
+appendmk(char *text) {
+    struct Map prev = aliasmap;
+    char **alias;
+    char *tok;
     size_t i;
-    size_t j;
-    size_t nlen;
 
-    if (s->len == 0) {
-        s->len = 1;
-        s->data = f;
-        return s;
+    /* the tokens point into text, which lives as long as the script */
+    reallocptr(&copymk, strlen(copymk) + strlen(text) + 1, 1);
+    strcat(copymk, text);
+    itertokm(text, PARSE_MODIFY);
+    while ((tok = itertokm(NULL, PARSE_MODIFY)) != NULL) {
+        pusharr(&tokarr, tok);
     }
-    hlv = s->data;
-    for (i = 0; i < s->len; ++i) {
-        nlen = hlv[i].len + f->len;
-        reallocptr(&hlv[i].data, nlen, sizeof(Str));
-        strp = hlv[i].data + hlv[i].len;
-        memcpy(strp, f->data, f->len * sizeof(Str));
-        for (j = 0; j < f->len; ++j) {
-            strp[j].data = memown(f->data[j].data, f->data[j].len);
+    sortstrarr(&quotarr);
+    mapfromarr(&aliasmap, &tokarr);
+    for (i = 0; i < prev.namearr.len; ++i) {
+        if (prev.node[i].val.anon) {
+            alias = searcharr((char **)prev.namearr.data + i,
+                              &aliasmap.namearr);
+            aliasmap.node[alias - chrbeg(&aliasmap.namearr)] = prev.node[i];
         }
-        hlv[i].len = nlen;
     }
-    freehlist(f);
-    freemem(f, sizeof(Hlist));
-    return s;
+    free(prev.namearr.data);
+    free(prev.node);
 }
 
-static struct Vlist *
-addvlistvlist(struct Vlist *f, struct Vlist *s) {
-    struct Hlist *fhlv;
-    struct Hlist *shlv;
-    struct Str *strv;
-    size_t i;
-    size_t minlen;
-    size_t nhlen;
-    size_t vdiff;
-
-    if (f->len == 0) {
-        freemem(f, sizeof(Vlist));
-        return s;
+#ifndef SAKE_LIB
+static int
+askserver(int argc, char **argv, int *status) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char *cwd = curdir();
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    int fdv[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    struct iovec iov;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cbuf,
+        .msg_controllen = sizeof(cbuf),
+    };
+    struct cmsghdr *cmsg;
+    size_t len = strlen(cwd) + strlen(fname) + 2;
+    char argcstr[16];
+    char *buf;
+    char *beg;
+    char **env;
+    int res;
+    int fd;
+    int i;
+
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", askpath) >=
+            (int)sizeof(addr.sun_path) ||
+        (fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1) {
+        return 0;
     }
-    if (s->len == 0) {
-        freemem(s, sizeof(Vlist));
-        return f;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return 0;
     }
-    if (f->len < s->len) {
-        minlen = f->len;
-        reallocptr(&f->data, s->len, sizeof(Hlist));
-        vdiff = s->len - minlen;
-        memcpy(f->data + minlen, s->data + minlen, vdiff * sizeof(Hlist));
-    } else {
-        minlen = s->len;
+    /* the whole command line and environment, they decide the jobs */
+    snprintf(argcstr, sizeof(argcstr), "%d", argc);
+    len += strlen(argcstr) + 1;
+    for (i = 0; i < argc; ++i) {
+        len += strlen(argv[i]) + 1;
     }
-    fhlv = f->data;
-    shlv = s->data;
-    for (i = 0; i < minlen; ++i) {
-        nhlen = shlv[i].len + fhlv[i].len;
-        reallocptr(&fhlv[i].data, nhlen, sizeof(Str));
-        strv = fhlv[i].data + fhlv[i].len;
-        memcpy(strv, shlv[i].data, shlv[i].len * sizeof(Str));
-        fhlv[i].len = nhlen;
+    for (env = environ; *env; ++env) {
+        len += strlen(*env) + 1;
     }
-    if (f->len == minlen) {
-        f->len = s->len;
+    if (len > SERVE_MSG) {
+        close(fd);
+        return 0;
     }
-    for (i = 0; i < minlen; ++i) {
-        freemem(shlv[i].data, shlv[i].len * sizeof(Str));
+    buf = alloc(len);
+    beg = stpcpy(buf, cwd) + 1;
+    beg = stpcpy(beg, fname) + 1;
+    beg = stpcpy(beg, argcstr) + 1;
+    for (i = 0; i < argc; ++i) {
+        beg = stpcpy(beg, argv[i]) + 1;
     }
-    freemem(s->data, s->len * sizeof(Hlist));
-    freemem(s, sizeof(Vlist));
-    return f;
+    for (env = environ; *env; ++env) {
+        beg = stpcpy(beg, *env) + 1;
+    }
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fdv));
+    memcpy(CMSG_DATA(cmsg), fdv, sizeof(fdv));
+    /* the server answers 0 once it runs the commands, then their status */
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) == -1 ||
+        recv(fd, &res, sizeof(res), 0) != sizeof(res) || res != 0) {
+        close(fd);
+        free(buf);
+        return 0;
+    }
+    if (recv(fd, status, sizeof(*status), 0) != sizeof(*status)) {
+        *status = EXIT_FAILURE;
+    }
+    close(fd);
+    free(buf);
+    return 1;
 }
 
-static struct Hlist *
-addhliststr(struct Hlist *f, struct Str *s) {
-    struct Str *str;
+static void
+recordusage(struct Job *job, struct rusage *ru, int status, int64_t wall) {
+    struct Usage *u = alloc(sizeof(Usage));
+
+    u->cmd = joinargs(&job->args);
+    u->status = status;
+    u->wall = wall;
+    u->utime = ru->ru_utime.tv_sec * 1000000000 + ru->ru_utime.tv_usec * 1000;
+    u->stime = ru->ru_stime.tv_sec * 1000000000 + ru->ru_stime.tv_usec * 1000;
+    u->maxrss = ru->ru_maxrss;
+    u->nvcsw = ru->ru_nvcsw;
+    u->nivcsw = ru->ru_nivcsw;
+    pusharr(&usagearr, u);
+}
 
-    if (f->len == 0) {
-        f->data = s;
-        f->len = 1;
-        return f;
-    }
-    str = &f->data[f->len - 1];
-    appendstr(str, s);
-    freestr(s);
-    freemem(s, sizeof(Str));
-    return f;
+static int
+sortusage(const void *f, const void *s) {
+    int64_t fw = (*(struct Usage **)f)->wall;
+    int64_t sw = (*(struct Usage **)s)->wall;
+
+    return (fw < sw) - (fw > sw);
 }
 
-static struct Vlist *
-addvliststr(struct Vlist *f, struct Str *s) {
-    struct Hlist *hlv;
-    size_t vlen;
-    size_t hlen;
+static void
+reportjobs(void) {
+    struct Usage **uv = (struct Usage **)usagearr.data;
+    int64_t elapsed = monons() - runstart;
+    int64_t wall = 0;
+    int64_t utime = 0;
+    int64_t stime = 0;
     size_t i;
+    FILE *f;
 
-    if (f->len == 0) {
-        hlv = f->data = emptyhlist();
-        hlv->len = 1;
-        hlv->data = s;
-        return f;
+    if (reportfile == NULL || usagearr.len == 0) {
+        return;
     }
-    hlv = f->data;
-    vlen = f->len;
-    for (i = 0; i < vlen; ++i) {
-        if ((hlen = hlv[i].len) == 0) {
-            hlv[i].len = 1;
-            hlv[i].data = copystr(s);
-            continue;
+    for (i = 0; i < usagearr.len; ++i) {
+        wall += uv[i]->wall;
+        utime += uv[i]->utime;
+        stime += uv[i]->stime;
+    }
+    qsort(uv, usagearr.len, sizeof(Usage *), sortusage);
+    fprintf(stderr,
+            "%zu jobs in %.3fs: %.3fs cpu (%.3fs user, %.3fs sys), "
+            "%.3fs job time, parallelism %.2f\n",
+            usagearr.len, elapsed / 1e9, (utime + stime) / 1e9, utime / 1e9,
+            stime / 1e9, wall / 1e9, elapsed ? (double)wall / elapsed : 0);
+    fprintf(stderr, "%10s %10s %10s  %s\n", "wall", "cpu", "maxrss", "cmd");
+    for (i = 0; i < usagearr.len && i < REPORT_TOP; ++i) {
+        fprintf(stderr, "%9.3fs %9.3fs %8lldkB  %s\n", uv[i]->wall / 1e9,
+                (uv[i]->utime + uv[i]->stime) / 1e9,
+                (long long)uv[i]->maxrss, uv[i]->cmd);
+    }
+    if ((f = fopen(reportfile, "w")) == NULL) {
+        warn("%s", reportfile);
+    } else {
+        fprintf(f, "wall_ns\tuser_ns\tsys_ns\tmaxrss_kb\tnvcsw\tnivcsw\t"
+                   "wstatus\tcmd\n");
+        for (i = 0; i < usagearr.len; ++i) {
+            fprintf(f, "%lld\t%lld\t%lld\t%lld\t%lld\t%lld\t%d\t%s\n",
+                    (long long)uv[i]->wall, (long long)uv[i]->utime,
+                    (long long)uv[i]->stime, (long long)uv[i]->maxrss,
+                    (long long)uv[i]->nvcsw, (long long)uv[i]->nivcsw,
+                    uv[i]->status, uv[i]->cmd);
+        }
+        if (fclose(f) == EOF) {
+            warn("%s", reportfile);
         }
-        appendstr(&hlv[i].data[hlen - 1], s);
     }
-    freestr(s);
-    freemem(s, sizeof(Str));
-    return f;
+    for (i = 0; i < usagearr.len; ++i) {
+        free(uv[i]->cmd);
+        free(uv[i]);
+    }
+    usagearr.len = 0;
 }
 
-static struct Str *
-concatstr(struct Str *f, struct Str *s) {
-    return addstrstr(f, s);
-}
+static char *
+joinargs(struct Hlist *args) {
+    size_t len = 0;
+    char *res;
+    size_t i;
 
-static struct Hlist *
-concathlist(struct Hlist *f, struct Hlist *s) {
-    return addhlisthlist(f, s);
+    for (i = 0; i < args->len; ++i) {
+        len += args->data[i].len;
+    }
+    res = alloc(len);
+    for (i = 0, len = 0; i < args->len; ++i) {
+        memcpy(res + len, flatstr(args->data + i), args->data[i].len);
+        len += args->data[i].len;
+        res[len - 1] = ' ';
+    }
+    res[len - 1] = '\0';
+    return res;
 }
 
-static struct Vlist *
-concatvlist(struct Vlist *f, struct Vlist *s) {
-    size_t len = f->len + s->len;
-
-    reallocptr(&f->data, len, sizeof(Hlist));
-    memcpy(f->data + f->len, s->data, s->len * sizeof(Hlist));
-    f->len = len;
-    freemem(s->data, s->len * sizeof(Hlist));
-    freemem(s, sizeof(Vlist));
-    return f;
+static void
+opentrace(const char *path) {
+    if ((tracef = fopen(path, "w")) == NULL) {
+        err(1, "fopen %s", path);
+    }
+    tracestart = monons();
+    fprintf(tracef, "{\"traceEvents\":[\n");
+    traceevent("M", "__metadata", "thread_name", 0, 0, 0, "main");
+    atexit(closetrace);
 }
 
 static void
-execbinaryop(struct Var *f, struct Var *s, char *op) {
-
-    assert(isbinaryop(op));
+closetrace(void) {
+    fprintf(tracef, "\n]}\n");
+    fclose(tracef);
+}
 
-    if (op == litts[SYM_PLUS]) {
-        addval(f, s);
-        return;
-    } else if (op == litts[SYM_SUB]) {
-        subval(f, s);
-        return;
-    } else if (op == litts[SYM_MOD] || op == litts[SYM_DIV]) {
-        filtval(f, s, op);
-        return;
-    }
-    errx(1, "unimplemented, %s", op);
+static int64_t
+tracenow(void) {
+    return tracef ? monons() : 0;
 }
 
 static void
-addval(struct Var *f, struct Var *s) {
-    switch (f->type) {
-    case TYPE_STR:
-        switch (s->type) {
-        case TYPE_STR:
-            f->type = TYPE_STR;
-            f->val.str = addstrstr(f->val.str, s->val.str);
-            return;
-        case TYPE_HLIST:
-            f->type = TYPE_HLIST;
-            f->val.hlist = addstrhlist(f->val.str, s->val.hlist);
-            return;
-        case TYPE_VLIST:
-            f->type = TYPE_VLIST;
-            f->val.vlist = addstrvlist(f->val.str, s->val.vlist);
-            return;
-        }
-    case TYPE_HLIST:
-        switch (s->type) {
-        case TYPE_STR:
-            f->type = TYPE_HLIST;
-            f->val.hlist = addhliststr(f->val.hlist, s->val.str);
-            return;
-        case TYPE_HLIST:
-            f->type = TYPE_HLIST;
-            f->val.hlist = addhlisthlist(f->val.hlist, s->val.hlist);
-            return;
-        case TYPE_VLIST:
-            f->type = TYPE_VLIST;
-            f->val.vlist = addhlistvlist(f->val.hlist, s->val.vlist);
-            return;
-        }
-    case TYPE_VLIST:
-        switch (s->type) {
-        case TYPE_STR:
-            f->type = TYPE_VLIST;
-            f->val.vlist = addvliststr(f->val.vlist, s->val.str);
-            return;
-        case TYPE_HLIST:
-            f->type = TYPE_VLIST;
-            f->val.vlist = addvlisthlist(f->val.vlist, s->val.hlist);
-            return;
-        case TYPE_VLIST:
-            f->type = TYPE_VLIST;
-            f->val.vlist = addvlistvlist(f->val.vlist, s->val.vlist);
-            return;
-        }
+traceevent(const char *ph, const char *cat, const char *name, int64_t beg,
+           int64_t end, long tid, const char *arg) {
+    static int first = 1;
+
+    pthread_mutex_lock(&tracelock);
+    fprintf(tracef, "%s{\"ph\":\"%s\",\"cat\":\"%s\",\"name\":",
+            first ? "" : ",\n", ph, cat);
+    tracestr(name);
+    fprintf(tracef, ",\"pid\":%ld,\"tid\":%ld", (long)getpid(), tid);
+    if (*ph == 'M') {
+        fprintf(tracef, ",\"args\":{\"name\":");
+        tracestr(arg);
+        fputc('}', tracef);
+    } else {
+        fprintf(tracef, ",\"ts\":%.3f", (beg - tracestart) / 1e3);
+    }
+    if (*ph == 'X') {
+        fprintf(tracef, ",\"dur\":%.3f", (end - beg) / 1e3);
+    }
+    if (*ph != 'M' && arg) {
+        fprintf(tracef, ",\"id\":\"%s\"", arg);
     }
+    fputc('}', tracef);
+    first = 0;
+    pthread_mutex_unlock(&tracelock);
 }
 
-static int
-matchstrstr(struct Str *f, struct Str *s, enum POS pos, enum FIL fil) {
-    if (s->len == 0) {
-        return fil;
-    }
-    if (f->len < s->len) {
-        return !fil;
-    }
-    if (pos == POS_BEG) {
-        return memcmp(f->data, s->data, s->len - 1) == 0 ? fil : !fil;
+static void
+tracespan(const char *cat, const char *name, int64_t beg, long tid) {
+    if (tracef == NULL) {
+        return;
     }
-    return memcmp(f->data + f->len - s->len, s->data, s->len - 1) == 0 ? fil
-                                                                       : !fil;
+    traceevent("X", cat, name, beg, monons(), tid, NULL);
 }
 
-static struct Hlist *
-filthlist(struct Hlist *f, struct Str *s, enum POS pos, enum FIL fil) {
-    struct Str *strv = f->data;
-    size_t len = f->len;
-    size_t i;
+static void
+tracestmt(char **beg, char **end, int64_t t0) {
+    char name[80] = ";";
+    size_t len = 0;
 
-    if (f->len == 0) {
-        return f;
+    if (tracef == NULL) {
+        return;
     }
-    for (i = 0; i < f->len; ++i) {
-        if (matchstrstr(f->data + i, s, pos, fil)) {
-            memcpy(strv++, f->data + i, sizeof(Str));
+    for (; beg != end && len + 1 < sizeof(name); ++beg) {
+        len += snprintf(name + len, sizeof(name) - len, "%s%s",
+                        len ? " " : "", *beg);
+    }
+    traceevent("X", "stmt", name, t0, monons(), 0, NULL);
+}
+
+static void
+tracestr(const char *s) {
+    fputc('"', tracef);
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(tracef, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(tracef, "\\u%04x", *s);
         } else {
-            freestr(f->data + i);
-            --len;
+            fputc(*s, tracef);
         }
     }
-    reallocptr(&f->data, len, sizeof(Str));
-    f->len = len;
-    return f;
+    fputc('"', tracef);
 }
 
-static struct Hlist *
-subhliststr(struct Hlist *f, struct Str *s, enum POS pos) {
-    struct Str *strv = f->data;
-    size_t len;
-    size_t i;
+static long
+tracetid(void) {
+    long tid = syscall(SYS_gettid);
 
-    if (f->len == 0 || s->len == 0) {
-        return f;
-    }
-    for (i = 0; i < f->len; ++i) {
-        if (matchstrstr(f->data + i, s, pos, FIL_KEEP)) {
-            len = strv[i].len - s->len + 1;
-            if (pos == POS_END) {
-                strv[i].data[len - 1] = '\0';
-            } else {
-                memmove(strv[i].data, strv[i].data + s->len - 1, len);
-                strv[i].data[len - 1] = '\0';
-            }
-            reallocptr(&strv[i].data, len, 1);
-            strv[i].len = len;
-        }
-    }
-    return f;
+    /* the main thread shares the track of parsing and statements */
+    return tid == getpid() ? 0 : tid;
 }
 
-static struct Vlist *
-subvliststr(struct Vlist *f, struct Str *s, enum POS pos) {
-    size_t i;
+static void
+tracejob(struct Job *job) {
+    char slot[32];
+    char id[32];
+    char *cmd;
 
-    if (f->len == 0 || s->len == 0) {
-        return f;
+    if (tracef == NULL) {
+        return;
     }
-    for (i = 0; i < f->len; ++i) {
-        subhliststr(f->data + i, s, pos);
+    /* one track per slot, named the first time it is used, numbered
+     * past the largest pid_max so no thread shares it */
+    for (; traceslots <= job->slot; ++traceslots) {
+        snprintf(slot, sizeof(slot), "job slot %zu", traceslots);
+        traceevent("M", "__metadata", "thread_name", 0, 0,
+                   TRACE_SLOT0 + traceslots, slot);
     }
-    return f;
+    cmd = joinargs(&job->args);
+    snprintf(id, sizeof(id), "%zu", job->seq);
+    traceevent("b", "queue", cmd, job->queued, 0, 0, id);
+    traceevent("e", "queue", cmd, job->start, 0, 0, id);
+    traceevent("X", "job", cmd, job->start, monons(),
+               TRACE_SLOT0 + job->slot, NULL);
+    free(cmd);
 }
+#endif
 
 static void
-subval(struct Var *f, struct Var *s) {
-    enum POS pos;
-    struct Str *strdel;
-
-    switch (f->type) {
-    case TYPE_STR:
-        switch (s->type) {
-        case TYPE_STR:
-            errx(1, "unimplemented: %d", __LINE__);
-        case TYPE_HLIST:
-            pos = POS_BEG;
-            strdel = f->val.str;
-            f->type = TYPE_HLIST;
-            f->val.hlist = subhliststr(s->val.hlist, f->val.str, pos);
-            break;
-        case TYPE_VLIST:
-            pos = POS_BEG;
-            strdel = f->val.str;
-            f->type = TYPE_VLIST;
-            f->val.vlist = subvliststr(s->val.vlist, f->val.str, pos);
-            break;
-        }
-        freestr(strdel);
-        freemem(strdel, sizeof(Str));
-        break;
-    case TYPE_HLIST:
-        switch (s->type) {
-        case TYPE_STR:
-            pos = POS_END;
-            f->type = TYPE_HLIST;
-            f->val.hlist = subhliststr(f->val.hlist, s->val.str, pos);
-            freeval(s);
-            return;
-        case TYPE_HLIST:
-        case TYPE_VLIST:
-            errx(1, "unimplemented: %d", __LINE__);
-        }
-    case TYPE_VLIST:
-        switch (s->type) {
-        case TYPE_STR:
-            pos = POS_END;
-            f->type = TYPE_VLIST;
-            f->val.vlist = subvliststr(f->val.vlist, s->val.str, pos);
-            freeval(s);
-            return;
-        case TYPE_HLIST:
-        case TYPE_VLIST:
-            errx(1, "unimplemented: %d", __LINE__);
-        }
-    }
+addstats(void) {
+    pthread_mutex_lock(&statslock);
+    pusharr(&statsarr, &stats);
+    pthread_mutex_unlock(&statslock);
 }
 
-static struct Vlist *
-filtvlist(struct Vlist *f, struct Str *s, enum POS pos, enum FIL fil) {
-    struct Hlist *hlv = f->data;
-    size_t len = f->len;
+#ifndef SAKE_LIB
+static void
+printstats(void) {
+    static const char *types[] = { "str", "hlist", "vlist" };
+    static const char *names[] = {
+        [PHASE_READ] = "read",
+        [PHASE_TOKENIZE] = "tokenize",
+        [PHASE_MAP] = "map",
+        [PHASE_EVAL] = "eval",
+    };
+    struct Stats sum = { 0 };
+    struct Stats *t;
+    uint64_t *sumv = (uint64_t *)&sum;
+    uint64_t *tv;
     size_t i;
+    size_t j;
 
-    if (f->len == 0) {
-        return f;
+    /* pool threads are parked once their last job is joined */
+    pthread_mutex_lock(&statslock);
+    for (i = 0; i < statsarr.len; ++i) {
+        t = statsarr.data[i];
+        tv = (uint64_t *)t;
+        for (j = 0; j < sizeof(Stats) / sizeof(uint64_t); ++j) {
+            sumv[j] += tv[j];
+        }
     }
-    for (i = 0; i < f->len; ++i) {
-        filthlist(f->data + i, s, pos, fil);
-        if (f->data[i].len != 0) {
-            memcpy(hlv++, f->data + i, sizeof(Hlist));
-        } else {
-            --len;
+    pthread_mutex_unlock(&statslock);
+    fprintf(stderr,
+            "stats: tokens %zu\n"
+            "stats: searcharr %llu\n"
+            "stats: copyval %llu\n"
+            "stats: copyval_bytes %llu\n"
+            "stats: alloc %llu\n"
+            "stats: alloc_bytes %llu\n"
+            "stats: reallocptr %llu\n"
+            "stats: reallocptr_bytes %llu\n"
+            "stats: freemem %llu\n"
+            "stats: freemem_bytes %llu\n"
+            "stats: squalo_flush %llu\n"
+            "stats: fork %llu\n",
+            tokarr.len, (unsigned long long)sum.searches,
+            (unsigned long long)sum.copies, (unsigned long long)sum.copybytes,
+            (unsigned long long)sum.allocs, (unsigned long long)sum.allocbytes,
+            (unsigned long long)sum.reallocs,
+            (unsigned long long)sum.reallocbytes,
+            (unsigned long long)sum.frees, (unsigned long long)sum.freebytes,
+            (unsigned long long)sum.flushes, (unsigned long long)sum.forks);
+    for (i = 0; i < 3; ++i) {
+        for (j = 0; j < 3; ++j) {
+            if (sum.converts[i][j]) {
+                fprintf(stderr, "stats: convert_%s_%s %llu\n", types[i],
+                        types[j], (unsigned long long)sum.converts[i][j]);
+            }
         }
     }
-    reallocptr(&f->data, len, sizeof(Hlist));
-    f->len = len;
-    return f;
+    for (i = 0; i < PHASE_N; ++i) {
+        fprintf(stderr, "stats: %s_ns %lld\n", names[i], (long long)phases[i]);
+    }
 }
+#endif
 
+#ifdef SAKE_LIB
 static void
-filtval(struct Var *f, struct Var *s, char *op) {
-    enum FIL fil = (op == litts[SYM_MOD]) ? FIL_DISCARD : FIL_KEEP;
-    enum POS pos;
-    struct Str *strdel;
+enterctx(struct Sake *ctx, jmp_buf *jmp) {
+    fname = ctx->fname ? ctx->fname : "<eval>";
+    srcarr = &ctx->srcs;
+    copymk = ctx->copymk;
+    quotarr = ctx->quotarr;
+    tokarr = ctx->tokarr;
+    aliasmap = ctx->aliasmap;
+    stmtjmp = jmp;
+}
 
-    switch (f->type) {
-    case TYPE_STR:
-        switch (s->type) {
-        case TYPE_STR:
-            errx(1, "unimplemented: %d", __LINE__);
-        case TYPE_HLIST:
-            pos = POS_BEG;
-            strdel = f->val.str;
-            f->type = TYPE_HLIST;
-            f->val.hlist = filthlist(s->val.hlist, f->val.str, pos, fil);
-            break;
-        case TYPE_VLIST:
-            strdel = f->val.str;
-            pos = POS_BEG;
-            f->type = TYPE_VLIST;
-            f->val.vlist = filtvlist(s->val.vlist, f->val.str, pos, fil);
-            break;
-        }
-        freestr(strdel);
-        freemem(strdel, sizeof(Str));
-        break;
-    case TYPE_HLIST:
-        switch (s->type) {
-        case TYPE_STR:
-            pos = POS_END;
-            f->type = TYPE_HLIST;
-            f->val.hlist = filthlist(f->val.hlist, s->val.str, pos, fil);
-            freeval(s);
-            return;
-        case TYPE_HLIST:
-        case TYPE_VLIST:
-            errx(1, "unimplemented: %d", __LINE__);
-        }
-        break;
-    case TYPE_VLIST:
-        switch (s->type) {
-        case TYPE_STR:
-            pos = POS_END;
-            f->type = TYPE_VLIST;
-            f->val.vlist = filtvlist(f->val.vlist, s->val.str, pos, fil);
-            freeval(s);
-            return;
-        case TYPE_HLIST:
-        case TYPE_VLIST:
-            errx(1, "unimplemented: %d", __LINE__);
-        }
-    }
+/* the text appended next to copymk comes from name */
+static void
+addsource(struct Sake *ctx, const char *name) {
+    struct Source *src = alloc(sizeof(Source));
+
+    src->off = ctx->mklen;
+    src->name = memown((char *)name, strlen(name) + 1);
+    pusharr(&ctx->srcs, src);
 }
 
-static struct Hlist *
-atstr(struct Str *dname, char **cmd) {
-    struct Hlist *files = emptyhlist();
-    struct Str *strv = alloc(64 * sizeof(Str));
-    size_t len = 0;
-    struct dirent *dirp;
-    DIR *dir;
+static void
+leavectx(struct Sake *ctx) {
+    ctx->copymk = copymk;
+    ctx->quotarr = quotarr;
+    ctx->tokarr = tokarr;
+    ctx->aliasmap = aliasmap;
+    srcarr = NULL;
+    stmtjmp = NULL;
+    dropthread();
+}
 
-    if (dname->len < 2) {
-        sigerrn(cmd - chrbeg(&tokarr), "empty directory name");
+static void
+dropthread(void) {
+    /* the thread may never come back for what it keeps between calls */
+    flushmem();
+    free(squalo.delay.data);
+    memset(&squalo.delay, 0, sizeof(Arr));
+    free(sched.pending.data);
+    memset(&sched.pending, 0, sizeof(Arr));
+    free(sched.running.data);
+    memset(&sched.running, 0, sizeof(Arr));
+    free(history.data);
+    history.data = NULL;
+    history.len = 0;
+}
+
+Sake *
+sakeopen(void) {
+    struct Sake *ctx;
+
+    if ((ctx = calloc(1, sizeof(Sake))) == NULL) {
+        return NULL;
+    }
+    if ((ctx->copymk = strdup("")) == NULL) {
+        free(ctx);
+        return NULL;
     }
-    if ((dir = opendir(dname->data)) == NULL) {
-        err(1, "opendir");
+    ctx->mkalloc = 1;
+    return ctx;
+}
+
+int
+sakeload(Sake *ctx, const char *path) {
+    size_t ntok = ctx->tokarr.len;
+    volatile int rc = SAKE_ESYS;
+    volatile int e = 0;
+    jmp_buf jmp;
+    char *text;
+
+    free(ctx->fname);
+    if ((ctx->fname = strdup(path)) == NULL) {
+        return SAKE_ESYS;
     }
-    while ((dirp = readdir(dir)) != NULL) {
-        strv[len].hash = 1;
-        strv[len].len = strlen(dirp->d_name) + 1;
-        strv[len].data = memown(dirp->d_name, strv[len].len);
-        if (((++len) % 64) == 0) {
-            reallocptr(&strv, len + 64, sizeof(Str));
+    enterctx(ctx, &jmp);
+    if (setjmp(jmp)) {
+        /* readall jumps with errno still from the failing call */
+        e = errno;
+    } else {
+        text = readall(path);
+        rc = SAKE_ESCRIPT;
+        pusharr(&ctx->texts, text);
+        addsource(ctx, fname);
+        appendmk(text);
+        if (tokarr.len > ntok &&
+            chrbeg(&tokarr)[tokarr.len - 1] != litts[SYM_SEMICOL]) {
+            sigerrn(tokarr.len - 1, "missing terminating semicolon");
         }
+        evalmk(chrbeg(&tokarr) + ntok, chrend(&tokarr));
+        rc = SAKE_OK;
     }
-    reallocptr(&strv, len, sizeof(Str));
-    qsort(strv, len, sizeof(Str), cmpstr);
-    files->len = len;
-    files->data = strv;
-    closedir(dir);
-    freestr(dname);
-    freemem(dname, sizeof(Str));
+    leavectx(ctx);
+    ctx->mklen = strlen(ctx->copymk);
+    ctx->mkalloc = ctx->mklen + 1;
+    if (rc == SAKE_ESYS) {
+        errno = e;
+    }
+    return rc;
+}
 
-    return files;
+int
+sakeeval(Sake *ctx, const char *expr, SakeVal **res) {
+    size_t ntok = ctx->tokarr.len;
+    size_t nquot = ctx->quotarr.len;
+    size_t len = strlen(expr);
+    struct SakeVal *val = alloc(sizeof(SakeVal));
+    volatile int rc = SAKE_ESCRIPT;
+    struct Vlist *vl;
+    jmp_buf jmp;
+    char *text;
+    char *tok;
+    size_t i;
+
+    /* past the script only while it runs, for the error lines */
+    if (ctx->mklen + len + 2 > ctx->mkalloc) {
+        ctx->mkalloc = (ctx->mklen + len + 2) * 2;
+        reallocptr(&ctx->copymk, ctx->mkalloc, 1);
+    }
+    memcpy(ctx->copymk + ctx->mklen, expr, len);
+    strcpy(ctx->copymk + ctx->mklen + len, ";");
+    text = memown(ctx->copymk + ctx->mklen, len + 2);
+    addsource(ctx, "<eval>");
+    enterctx(ctx, &jmp);
+    if (setjmp(jmp) == 0) {
+        itertokm(text, PARSE_MODIFY);
+        while ((tok = itertokm(NULL, PARSE_MODIFY)) != NULL) {
+            pusharr(&tokarr, tok);
+        }
+        evalexpr(&val->var, chrbeg(&tokarr) + ntok, chrend(&tokarr) - 1);
+        waitjobs(JOB_ALL);
+        /* flat once here, so reading the words never copies */
+        if (val->var.type == TYPE_STR) {
+            flatstr(val->var.val.str);
+        } else if (val->var.type == TYPE_HLIST) {
+            flathlist(val->var.val.hlist);
+        } else {
+            vl = val->var.val.vlist;
+            for (i = 0; i < vl->len; ++i) {
+                flathlist(vl->data + i);
+            }
+        }
+        rc = SAKE_OK;
+    }
+    leavectx(ctx);
+    ctx->tokarr.len = ntok;
+    ctx->quotarr.len = nquot;
+    ctx->copymk[ctx->mklen] = '\0';
+    free(((struct Source *)ctx->srcs.data[--ctx->srcs.len])->name);
+    free(ctx->srcs.data[ctx->srcs.len]);
+    free(text);
+    if (rc != SAKE_OK) {
+        free(val);
+        return rc;
+    }
+    *res = val;
+    return SAKE_OK;
 }
 
-static int
-cmpstr(const void *f, const void *s) {
-    struct Str const *fs = f;
-    struct Str const *ss = s;
+size_t
+sakerows(const SakeVal *val) {
+    if (val->var.type == TYPE_VLIST) {
+        return val->var.val.vlist->len;
+    }
+    return 1;
+}
 
-    return strcmp(fs->data, ss->data);
+size_t
+sakewords(const SakeVal *val, size_t row) {
+    if (val->var.type == TYPE_STR) {
+        return 1;
+    } else if (val->var.type == TYPE_HLIST) {
+        return val->var.val.hlist->len;
+    }
+    return val->var.val.vlist->data[row].len;
 }
 
-static void
-atval(struct Var *v, char **cmd) {
-    switch (v->type) {
-    case TYPE_STR:
-        v->type = TYPE_HLIST;
-        v->val.hlist = atstr(v->val.str, cmd);
-        break;
-    case TYPE_HLIST:
-    case TYPE_VLIST:
-        errx(1, "unimplemented: %d", __LINE__);
+const char *
+sakeword(const SakeVal *val, size_t row, size_t word, size_t *len) {
+    struct Str *str;
+
+    if (val->var.type == TYPE_STR) {
+        str = val->var.val.str;
+    } else if (val->var.type == TYPE_HLIST) {
+        str = val->var.val.hlist->data + word;
+    } else {
+        str = val->var.val.vlist->data[row].data + word;
     }
+    if (len) {
+        *len = str->len - 1;
+    }
+    return str->data;
 }
 
-static void
-freemem(void *p, size_t size) {
+void
+sakefree(SakeVal *val) {
+    freeval(&val->var);
+    free(val);
+    dropthread();
+}
+
+void
+sakeclose(Sake *ctx) {
     size_t i;
 
-    if (DEALLOC_QUOTA == 0) {
-        free(p);
-        return;
+    for (i = 0; i < ctx->aliasmap.namearr.len; ++i) {
+        if (ctx->aliasmap.node[i].val.anon) {
+            freeval(ctx->aliasmap.node + i);
+        }
     }
-    if (size > DEALLOC_QUOTA) {
-        free(p);
-        return;
+    for (i = 0; i < ctx->texts.len; ++i) {
+        free(ctx->texts.data[i]);
     }
-    if (squalo.store + size > DEALLOC_QUOTA) {
-        for (i = 0; i < squalo.delay.len; ++i) {
-            free(squalo.delay.data[i]);
-        }
-        squalo.delay.len = 0;
-        squalo.store = 0;
+    for (i = 0; i < ctx->srcs.len; ++i) {
+        free(((struct Source *)ctx->srcs.data[i])->name);
+        free(ctx->srcs.data[i]);
     }
-    pusharr(&squalo.delay, p);
-    squalo.store += size;
+    free(ctx->srcs.data);
+    free(ctx->aliasmap.namearr.data);
+    free(ctx->aliasmap.node);
+    free(ctx->tokarr.data);
+    free(ctx->quotarr.data);
+    free(ctx->texts.data);
+    free(ctx->copymk);
+    free(ctx->fname);
+    free(ctx);
+    dropthread();
 }
-
+#endif
@@ -0,0 +1,47 @@
+// embedding interface of sake.c built with -DSAKE_LIB
+
+#ifndef SAKE_H
+#define SAKE_H
+
+#include <stddef.h>
+
+/*
+ * A context holds one script: its tokens, its aliases and their values.
+ * It is used by one thread at a time, any thread; contexts on different
+ * threads run concurrently. Values belong to the context evaluating them.
+ *
+ * Errors of a script and failing system calls while evaluating it, like
+ * a directory that cannot be listed or a command that cannot be forked,
+ * return SAKE_ESCRIPT with the message on stderr. The process still
+ * exits when memory or threads run out, on failing getcwd and on
+ * internal bugs.
+ */
+typedef struct Sake Sake;
+typedef struct SakeVal SakeVal;
+
+typedef enum SAKEERR {
+    SAKE_OK = 0,
+    SAKE_ESCRIPT = 1,
+    SAKE_ESYS = 2,
+} SAKEERR;
+
+/* empty context, NULL when out of memory */
+Sake *sakeopen(void);
+/*
+ * Appends the statements of fname and evaluates them like sake would,
+ * executing their commands. SAKE_ESYS reports a file it could not read,
+ * with the message on stderr and errno set. The statements evaluated
+ * before an error keep their aliases.
+ */
+int sakeload(Sake *, const char *fname);
+/* evaluates expr against the aliases loaded so far into *res */
+int sakeeval(Sake *, const char *expr, SakeVal **res);
+/* a string is one row of one word, an hlist one row, a vlist rows */
+size_t sakerows(const SakeVal *);
+size_t sakewords(const SakeVal *, size_t row);
+/* points into the value, valid until sakefree, len excludes the NUL */
+const char *sakeword(const SakeVal *, size_t row, size_t word, size_t *len);
+void sakefree(SakeVal *);
+void sakeclose(Sake *);
+
+#endif